@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#version 150 core
+
+out vec4 out_colour;
+
+uniform sampler2D indices;
+uniform sampler2D line_palettes;
+uniform sampler2D palettes;
+
+/*
+ * Look up the colour of each pixel of an indexed frame, in the copy of the
+ * colour table for its line. Drawn to a texture of the same size, so the
+ * fragment coordinates give the pixel.
+ */
+void main()
+{
+	ivec2 pos = ivec2(gl_FragCoord.xy);
+	int index = int(texelFetch(indices, pos, 0).r * 255.0 + 0.5);
+	int palette = int(texelFetch(line_palettes, ivec2(pos.y, 0), 0).r * 255.0 + 0.5);
+	/* Colours are 0xRRGGBBAA, so are byte-swapped in the texture */
+	out_colour = texelFetch(palettes, ivec2(index, palette), 0).abgr;
+}
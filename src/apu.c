@@ -15,7 +15,9 @@
 #include "gbcc.h"
 #include "memory.h"
 #include "nelem.h"
+#include "scheduler.h"
 #include "time_diff.h"
+#include "timer.h"
 #include <stdint.h>
 #include <time.h>
 
@@ -36,7 +38,8 @@ static void length_counter_clock(struct channel *ch);
 static uint16_t frequency_calc(struct sweep *sweep);
 static bool timer_clock(struct timer *timer);
 static void timer_reset(struct timer *timer);
-static bool duty_clock(struct duty *duty);
+static uint64_t timer_advance(struct timer *timer, uint64_t clocks);
+static bool duty_advance(struct duty *duty, uint64_t clocks);
 static void envelope_clock(struct envelope *envelope);
 static void time_sync(struct gbcc_core *gbc);
 static void ch1_trigger(struct gbcc_core *gbc);
@@ -47,61 +50,76 @@ static void ch4_trigger(struct gbcc_core *gbc);
 void gbcc_apu_init(struct gbcc_core *gbc)
 {
 	gbc->apu = (struct apu){0};
+	gbc->apu.sync_time = GBCC_SCHEDULER_DOT(gbc->scheduler.time);
 	gbc->apu.wave.addr = WAVE_START;
 	clock_gettime(CLOCK_REALTIME, &gbc->apu.start_time);
+	gbcc_scheduler_schedule(gbc, GBCC_EVENT_APU, gbc->apu.sync_time + 2 * CLOCKS_PER_SYNC);
 }
 
-ANDROID_INLINE
-void gbcc_apu_clock(struct gbcc_core *gbc)
+void gbcc_apu_event(struct gbcc_core *gbc)
 {
-	struct apu *apu = &gbc->apu;
 	if (!gbc->sync_to_video) {
-		apu->sync_clock++;
-		if (apu->sync_clock == CLOCKS_PER_SYNC) {
-			apu->sync_clock = 0;
-			apu->sample++;
-			time_sync(gbc);
-		}
+		gbc->apu.sample++;
+		time_sync(gbc);
 	}
+	gbcc_scheduler_schedule(gbc, GBCC_EVENT_APU, gbc->scheduler.time + 2 * CLOCKS_PER_SYNC);
+}
+
+/*
+ * The channel timers are only clocked when something needs to look at them
+ * (register accesses, the frame sequencer and audio sampling), at which
+ * point all of the clocks since the last sync are applied at once.
+ */
+void gbcc_apu_sync(struct gbcc_core *gbc)
+{
+	struct apu *apu = &gbc->apu;
+	uint64_t now = GBCC_SCHEDULER_DOT(gbc->scheduler.time);
+	uint64_t clocks = (now - apu->sync_time) / 2;
+	apu->sync_time = now;
 
-	if (apu->disabled) {
+	if (clocks == 0 || apu->disabled) {
 		return;
 	}
 
 	/* Duty */
 	/* Duty cycle doesn't clock after powering on until first trigger */
 	if (apu->ch1.duty.enabled) {
-		apu->ch1.state = duty_clock(&apu->ch1.duty);
+		apu->ch1.state = duty_advance(&apu->ch1.duty, clocks);
 	}
 	if (apu->ch2.duty.enabled) {
-		apu->ch2.state = duty_clock(&apu->ch2.duty);
+		apu->ch2.state = duty_advance(&apu->ch2.duty, clocks);
 	}
 
 	/* Noise */
 	/*
 	 * < 14 check is some obscure behaviour, where the lfsr isn't clocked
-	 * if the shift is 14 or 15. Short-circuiting prevents timer_clock
-	 * being called in this case.
+	 * if the shift is 14 or 15.
 	 */
-	if (apu->noise.shift < 14 && timer_clock(&apu->noise.timer)) {
-		uint8_t lfsr_low = apu->noise.lfsr & 0xFFu;
-		uint8_t tmp = check_bit(lfsr_low, 0) ^ check_bit(lfsr_low, 1);
-		apu->noise.lfsr >>= 1u;
-		apu->noise.lfsr &= ~bit16(14);
-		apu->noise.lfsr |= tmp * bit16(14);
-		if (apu->noise.width_mode) {
-			apu->noise.lfsr &= ~bit(6);
-			apu->noise.lfsr |= tmp * bit(6);
+	if (apu->noise.shift < 14) {
+		uint64_t ticks = timer_advance(&apu->noise.timer, clocks);
+		for (; ticks > 0; ticks--) {
+			uint8_t lfsr_low = apu->noise.lfsr & 0xFFu;
+			uint8_t tmp = check_bit(lfsr_low, 0) ^ check_bit(lfsr_low, 1);
+			apu->noise.lfsr >>= 1u;
+			apu->noise.lfsr &= ~bit16(14);
+			apu->noise.lfsr |= tmp * bit16(14);
+			if (apu->noise.width_mode) {
+				apu->noise.lfsr &= ~bit(6);
+				apu->noise.lfsr |= tmp * bit(6);
+			}
+			apu->ch4.state = !check_bit16(apu->noise.lfsr, 0);
 		}
-		apu->ch4.state = !check_bit16(apu->noise.lfsr, 0);
 	}
 
 	/* Wave */
-	if (timer_clock(&apu->wave.timer)) {
-		apu->wave.position++;
-		apu->wave.position &= 31u;
+	uint64_t ticks = timer_advance(&apu->wave.timer, clocks);
+	if (ticks > 0) {
+		/*
+		 * Only the last sample matters here, as wave RAM accesses
+		 * always sync the APU first.
+		 */
+		apu->wave.position = (uint8_t)((apu->wave.position + ticks) & 31u);
 		apu->wave.addr = WAVE_START + (apu->wave.position / 2);
-		//printf("Wave clocked to %04X\n", apu->wave.addr);
 		apu->wave.buffer = gbcc_memory_read_force(gbc, apu->wave.addr);
 		/* Alternates between high & low nibble, high first */
 		if (apu->wave.position % 2) {
@@ -135,20 +153,29 @@ void timer_reset(struct timer *timer)
 }
 
 
-bool duty_clock(struct duty *duty)
+/*
+ * Clock a timer many times at once, returning how many times it expired.
+ * A counter or period of 0 behaves like 0x10000, as the counter wraps
+ * around before reaching 0 again.
+ */
+uint64_t timer_advance(struct timer *timer, uint64_t clocks)
+{
+	uint32_t until = timer->counter ? timer->counter : 0x10000u;
+	if (clocks < until) {
+		timer->counter -= (uint16_t)clocks;
+		return 0;
+	}
+	clocks -= until;
+	uint32_t period = timer->period ? timer->period : 0x10000u;
+	timer->counter = (uint16_t)(period - clocks % period);
+	return 1 + clocks / period;
+}
+
+bool duty_advance(struct duty *duty, uint64_t clocks)
 {
 	duty->timer.period = (2048u - duty->freq) * 4;
-	/*
-	 * Manually clock the duty timer here for performance reasons, rather
-	 * than calling timer_clock.
-	 */
-	if (duty->timer.counter == 1) {
-		duty->counter++;
-		duty->counter %= 8u;
-		duty->timer.counter = duty->timer.period;
-	} else {
-		duty->timer.counter--;
-	}
+	uint64_t ticks = timer_advance(&duty->timer, clocks);
+	duty->counter = (uint8_t)((duty->counter + ticks) % 8u);
 
 	return duty_table[duty->cycle][duty->counter];
 }
@@ -181,6 +208,8 @@ uint16_t frequency_calc(struct sweep *sweep)
 
 void gbcc_apu_sequencer_clock(struct gbcc_core *gbc)
 {
+	gbcc_apu_sync(gbc);
+
 	/* Length counters every other clock */
 	if (!(gbc->apu.sequencer_counter & 0x01u)) {
 		if (gbc->apu.ch1.length_enable && gbc->apu.ch1.enabled) {
@@ -252,6 +281,7 @@ void time_sync(struct gbcc_core *gbc)
 void gbcc_apu_memory_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 {
 	uint8_t tmp;
+	gbcc_apu_sync(gbc);
 	switch (addr) {
 		case NR10:
 			gbc->apu.sweep.period = (val & 0x70u) >> 4u;
@@ -450,6 +480,8 @@ void gbcc_apu_memory_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 			gbc->apu.ch1.right = check_bit(val, 0);
 			break;
 		case NR52:
+			/* The frame sequencer is clocked by the timer */
+			gbcc_timer_sync(gbc, gbc->scheduler.time - 1);
 			gbc->apu.disabled = !check_bit(val, 7);
 			if (gbc->apu.disabled) {
 				for (size_t i = NR10; i < NR52; i++) {
@@ -458,6 +490,7 @@ void gbcc_apu_memory_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 				gbcc_apu_init(gbc);
 				gbc->apu.disabled = true;
 			}
+			gbcc_timer_reschedule(gbc);
 			break;
 		default:
 			gbcc_log_error("Invalid APU address 0x%04X\n", addr);
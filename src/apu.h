@@ -77,7 +77,7 @@ struct channel {
 };
 
 struct apu {
-	uint16_t sync_clock;
+	uint64_t sync_time;
 	uint16_t sample;
 	uint8_t left_vol;
 	uint8_t right_vol;
@@ -96,7 +96,8 @@ struct apu {
 };
 
 void gbcc_apu_init(struct gbcc_core *gbc);
-void gbcc_apu_clock(struct gbcc_core *gbc);
+void gbcc_apu_event(struct gbcc_core *gbc);
+void gbcc_apu_sync(struct gbcc_core *gbc);
 void gbcc_apu_sequencer_clock(struct gbcc_core *gbc);
 void gbcc_apu_memory_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
 
@@ -13,16 +13,18 @@
 #include "debug.h"
 #include "gbcc.h"
 #include "nelem.h"
+#include "ppu.h"
 #include "save.h"
 #include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static void usage()
 {
-	printf("Usage: gbcc [-aAbfFhivV] [-c config_file] [-p palette] [-s shader] [-t speed] rom\n"
+	printf("Usage: gbcc [-aAbfFhivV] [-c config_file] [-k frames] [-p palette] [-s shader] [-t speed] rom\n"
 	       "  -a, --autoresume      Automatically resume gameplay if possible.\n"
 	       "  -A, --autosave        Automatically save SRAM after last write.\n"
 	       "  -b, --background      Enable playback while unfocused.\n"
@@ -32,6 +34,8 @@ static void usage()
 	       "  -F, --frame-blending  Enable simple frame blending.\n"
 	       "  -h, --help            Print this message and exit.\n"
 	       "  -i, --interlacing     Enable interlacing.\n"
+	       "  -k, --frame-skip=NUM  Skip drawing NUM frames after each one drawn, or\n"
+	       "                        'auto' to skip those that won't be displayed.\n"
 	       "  -p, --palette=NAME    Select the colour palette (DMG mode only).\n"
 	       "  -s, --shader=NAME     Select the initial shader to use.\n"
 	       "  -S, --save-dir=PATH   Path to use for save files.\n"
@@ -56,6 +60,7 @@ bool gbcc_parse_args(struct gbcc *gbc, bool file_required, int argc, char **argv
 		{"frame-blending", no_argument, NULL, 'F'},
 		{"help", no_argument, NULL, 'h'},
 		{"interlacing", no_argument, NULL, 'i'},
+		{"frame-skip", required_argument, NULL, 'k'},
 		{"palette", required_argument, NULL, 'p'},
 		{"shader", required_argument, NULL, 's'},
 		{"save-dir", required_argument, NULL, 'S'},
@@ -64,7 +69,7 @@ bool gbcc_parse_args(struct gbcc *gbc, bool file_required, int argc, char **argv
 		{"vram-window", no_argument, NULL, 'V'},
 		{0, 0, 0, 0}
 	};
-	const char *short_options = "aAbc:C:fFhip:s:S:t:vV";
+	const char *short_options = "aAbc:C:fFhik:p:s:S:t:vV";
 
 	for (int opt; (opt = getopt_long(argc, argv, short_options, long_options, NULL)) != -1;) {
 		if (opt == 'h') {
@@ -124,8 +129,30 @@ bool gbcc_parse_args(struct gbcc *gbc, bool file_required, int argc, char **argv
 			case 'i':
 				gbc->interlacing = true;
 				break;
+			case 'k':
+			{
+				if (strcmp(optarg, "auto") == 0) {
+					gbc->core.frame_skip_auto = true;
+					break;
+				}
+				errno = 0;
+				char *endptr;
+				unsigned long frames = strtoul(optarg, &endptr, 10);
+				if (endptr == optarg || *endptr != '\0') {
+					gbcc_log_error("Failed to parse frame skip '%s'.\n", optarg);
+					usage();
+					return false;
+				} else if (errno || frames > UINT8_MAX) {
+					gbcc_log_error("Frame skip '%s' out of range.\n", optarg);
+					usage();
+					return false;
+				}
+				gbc->core.frame_skip = (uint8_t)frames;
+				gbc->core.frame_skip_auto = false;
+				break;
+			}
 			case 'p':
-				gbc->core.ppu.palette = gbcc_get_palette(optarg);
+				gbcc_ppu_set_palette(&gbc->core, gbcc_get_palette(optarg));
 				gbcc_log_debug("%s palette selected\n", gbc->core.ppu.palette.name);
 				break;
 			case 's':
@@ -149,6 +176,7 @@ bool gbcc_parse_args(struct gbcc *gbc, bool file_required, int argc, char **argv
 				break;
 			case '?':
 				if (optopt == 'c'
+						|| optopt == 'k'
 						|| optopt == 'p'
 						|| optopt == 's'
 						|| optopt == 'S'
@@ -16,6 +16,7 @@
 /* Max channel amplitude / max envelope volume multiplier */
 #define BASE_AMPLITUDE (MAX_CHANNEL_AMPLITUDE / 0x10u)
 
+static float clock_multiplier(struct gbcc *gbc);
 static void ch1_update(struct gbcc *gbc);
 static void ch2_update(struct gbcc *gbc);
 static void ch3_update(struct gbcc *gbc);
@@ -41,23 +42,59 @@ void gbcc_audio_destroy(struct gbcc *gbc)
 	free(gbc->audio.mix_buffer);
 }
 
-ANDROID_INLINE
-void gbcc_audio_update(struct gbcc *gbc)
+/*
+ * How many cycles make up one sample at the current emulation speed, relative
+ * to normal, or 0 if no audio is being output.
+ */
+float clock_multiplier(struct gbcc *gbc)
 {
-	struct gbcc_audio *audio = &gbc->audio;
-
 	float mult = 1;
 	if (gbc->core.keys.turbo) {
 		if (gbc->turbo_speed > 0) {
 			mult = gbc->turbo_speed;
 		} else {
-			return;
+			return 0;
 		}
 	}
-	audio->clock++;
 	if (gbc->core.sync_to_video) {
-		mult /= audio->scale;
+		mult /= gbc->audio.scale;
+	}
+	return mult;
+}
+
+/*
+ * The number of cycles that can be emulated before the next sample is due.
+ * Callers shouldn't pass more than this to gbcc_audio_update().
+ */
+uint32_t gbcc_audio_cycles_until_sample(struct gbcc *gbc)
+{
+	struct gbcc_audio *audio = &gbc->audio;
+	float mult = clock_multiplier(gbc);
+	if (mult == 0) {
+		return UINT32_MAX;
+	}
+	float remaining = audio->clocks_per_sample * mult * (float)audio->sample - audio->clock;
+	if (remaining <= 1) {
+		return 1;
+	}
+	/* Round up, so that we land on the cycle the sample is taken */
+	uint32_t cycles = (uint32_t)remaining;
+	if ((float)cycles < remaining) {
+		cycles++;
+	}
+	return cycles;
+}
+
+ANDROID_INLINE
+void gbcc_audio_update(struct gbcc *gbc, uint32_t cycles)
+{
+	struct gbcc_audio *audio = &gbc->audio;
+
+	float mult = clock_multiplier(gbc);
+	if (mult == 0) {
+		return;
 	}
+	audio->clock += (float)cycles;
 	/* When err > 0, it tells us how much we overshot the last sample by */
 	float err = audio->clock - audio->clocks_per_sample * mult * (float)audio->sample;
 	if (err >= 0) {
@@ -79,6 +116,7 @@ void gbcc_audio_update(struct gbcc *gbc)
 			audio->sample = 0;
 		}
 		audio->sample++;
+		gbcc_apu_sync(&gbc->core);
 		audio->mix_buffer[audio->index] = 0;
 		audio->mix_buffer[audio->index + 1] = 0;
 		ch1_update(gbc);
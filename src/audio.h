@@ -39,7 +39,8 @@ struct gbcc_audio {
 
 void gbcc_audio_initialise(struct gbcc *gbc, size_t sample_rate, size_t buffer_samples);
 void gbcc_audio_destroy(struct gbcc *gbc);
-void gbcc_audio_update(struct gbcc *gbc);
+void gbcc_audio_update(struct gbcc *gbc, uint32_t cycles);
+uint32_t gbcc_audio_cycles_until_sample(struct gbcc *gbc);
 void gbcc_audio_play_wav(const char *filename);
 
 void gbcc_audio_platform_initialise(struct gbcc *gbc);
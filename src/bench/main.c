@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+/*
+ * Headless benchmark for the different CPU execution modes.
+ *
+ * Each ROM is run for a fixed number of frames in every mode, and the time
+ * taken is printed alongside the speedup over the cycle-accurate core, and
+ * the proportion of cycles skipped over in idle loops and of lines the PPU
+ * drew in one go. The state at the end of each run is also hashed, along
+ * with every frame drawn during it, so that any mode which doesn't behave
+ * identically is caught.
+ */
+
+#include "../core.h"
+#include "../constants.h"
+#include "../cpu.h"
+#include "../debug.h"
+#include "../nelem.h"
+#include "../scheduler.h"
+#include "../time_diff.h"
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_FRAMES 3600
+/* Clocks needed for any block (at most 256 M-cycles) to finish */
+#define BLOCK_MARGIN (4 * 0x100)
+
+struct mode {
+	const char *name;
+	bool cycle_accurate;
+	bool block_executor;
+};
+
+static const struct mode modes[] = {
+	{.name = "cycle-accurate", .cycle_accurate = true, .block_executor = false},
+	{.name = "instruction", .cycle_accurate = false, .block_executor = false},
+	{.name = "block", .cycle_accurate = false, .block_executor = true}
+};
+
+static void usage(void);
+static bool run(const char *filename, const struct mode *mode, uint64_t frames, uint8_t frame_skip, bool indexed, uint64_t *time, uint64_t *hash, uint64_t *skipped, double *fast_lines);
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+static uint64_t hash_state(struct gbcc_core *gbc);
+static bool parse_number(const char *str, uint64_t max, uint64_t *result);
+
+int main(int argc, char **argv)
+{
+	uint64_t frames = DEFAULT_FRAMES;
+	uint8_t frame_skip = 0;
+	bool indexed = false;
+	for (int opt; (opt = getopt(argc, argv, "f:hik:")) != -1;) {
+		uint64_t value;
+		switch (opt) {
+			case 'f':
+				/* Cycles to run for must fit in 64 bits */
+				if (!parse_number(optarg, UINT64_MAX / GBC_FRAME_CLOCKS, &frames)) {
+					gbcc_log_error("Invalid number of frames '%s'.\n", optarg);
+					usage();
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'i':
+				indexed = true;
+				break;
+			case 'k':
+				if (!parse_number(optarg, UINT8_MAX, &value)) {
+					gbcc_log_error("Invalid frame skip '%s'.\n", optarg);
+					usage();
+					exit(EXIT_FAILURE);
+				}
+				frame_skip = (uint8_t)value;
+				break;
+			case 'h':
+				usage();
+				exit(EXIT_SUCCESS);
+			default:
+				usage();
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc || frames == 0) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	bool mismatch = false;
+	for (int i = optind; i < argc; i++) {
+		uint64_t times[N_ELEM(modes)];
+		uint64_t hashes[N_ELEM(modes)];
+		uint64_t skipped[N_ELEM(modes)];
+		double fast_lines[N_ELEM(modes)];
+		printf("%s (%" PRIu64 " frames):\n", argv[i], frames);
+		for (size_t m = 0; m < N_ELEM(modes); m++) {
+			if (!run(argv[i], &modes[m], frames, frame_skip, indexed, &times[m], &hashes[m], &skipped[m], &fast_lines[m])) {
+				exit(EXIT_FAILURE);
+			}
+			double seconds = (double)times[m] / SECOND;
+			double fps = (double)frames / seconds;
+			double speedup = (double)times[0] / (double)times[m];
+			double idle = 100.0 * (double)skipped[m] / (double)(frames * GBC_FRAME_CLOCKS);
+			printf("\t%-16s%8.3f s %10.1f fps %6.2fx %5.1f%% idle %5.1f%% fast  %016" PRIx64 "%s\n",
+					modes[m].name,
+					seconds,
+					fps,
+					speedup,
+					idle,
+					fast_lines[m],
+					hashes[m],
+					hashes[m] == hashes[0] ? "" : "  MISMATCH");
+			if (hashes[m] != hashes[0]) {
+				mismatch = true;
+			}
+		}
+	}
+	if (mismatch) {
+		gbcc_log_error("Execution modes disagree on the final state.\n");
+		exit(EXIT_FAILURE);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+void usage(void)
+{
+	printf("Usage: gbcc-bench [-f frames] [-i] [-k frames] rom_file...\n"
+	       "Run each ROM headlessly in every CPU execution mode, and compare.\n"
+	       "  -f, frames     Number of frames to run for (default %d).\n"
+	       "  -h             Print this help and exit.\n"
+	       "  -i             Draw frames as colour table indices.\n"
+	       "  -k, frames     Frames to skip drawing after each one drawn.\n",
+	       DEFAULT_FRAMES);
+}
+
+bool run(const char *filename, const struct mode *mode, uint64_t frames, uint8_t frame_skip, bool indexed, uint64_t *time, uint64_t *hash, uint64_t *skipped, double *fast_lines)
+{
+	static struct gbcc_core gbc;
+
+	/* WRAM is filled with random values, so make them the same each run */
+	srand(1);
+	gbcc_initialise(&gbc, filename);
+	if (gbc.error) {
+		gbcc_log_error("%s\n", gbc.error_msg);
+		gbcc_free(&gbc);
+		return false;
+	}
+	gbc.keys.turbo = true;
+	gbc.cycle_accurate = mode->cycle_accurate;
+	gbc.block_executor = mode->block_executor;
+	gbc.frame_skip = frame_skip;
+	gbc.indexed_output = indexed;
+
+	uint64_t cycles = frames * GBC_FRAME_CLOCKS;
+	struct timespec start;
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (uint64_t i = 0; i < cycles;) {
+		/*
+		 * Stop forming blocks just before the end, so every mode
+		 * finishes on the same instruction.
+		 */
+		uint64_t max_cycles = cycles - i;
+		if (max_cycles > BLOCK_MARGIN) {
+			max_cycles -= BLOCK_MARGIN;
+		} else {
+			gbc.block_executor = false;
+		}
+		if (max_cycles > UINT32_MAX) {
+			max_cycles = UINT32_MAX;
+		}
+		i += gbcc_emulate_cycles(&gbc, (uint32_t)max_cycles);
+		if (gbc.error) {
+			gbcc_log_error("Invalid opcode: 0x%02X\n", gbc.cpu.opcode);
+			gbcc_free(&gbc);
+			return false;
+		}
+	}
+	while (gbc.cpu.instruction.running || gbc.cpu.instruction.remaining > 0) {
+		gbcc_emulate_cycle(&gbc);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	*time = gbcc_time_diff(&end, &start);
+	*hash = hash_state(&gbc);
+	*skipped = gbc.idle.skipped;
+	uint64_t lines = gbc.ppu.fast_lines + gbc.ppu.slow_lines;
+	*fast_lines = lines ? 100.0 * (double)gbc.ppu.fast_lines / (double)lines : 0.0;
+	gbcc_free(&gbc);
+	return true;
+}
+
+/* Parse a whole decimal number no bigger than max */
+bool parse_number(const char *str, uint64_t max, uint64_t *result)
+{
+	errno = 0;
+	char *endptr;
+	unsigned long long value = strtoull(str, &endptr, 10);
+	if (endptr == str || *endptr != '\0' || errno || value > max) {
+		return false;
+	}
+	*result = value;
+	return true;
+}
+
+/* 64-bit FNV-1a */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001B3u;
+	}
+	return hash;
+}
+
+uint64_t hash_state(struct gbcc_core *gbc)
+{
+	gbcc_scheduler_sync(gbc);
+	uint64_t hash = 0xCBF29CE484222325u;
+	hash = hash_bytes(hash, &gbc->cpu.reg, sizeof(gbc->cpu.reg));
+	hash = hash_bytes(hash, gbc->memory.wram_bank, sizeof(gbc->memory.wram_bank));
+	hash = hash_bytes(hash, gbc->memory.vram_bank, sizeof(gbc->memory.vram_bank));
+	hash = hash_bytes(hash, gbc->memory.oam, sizeof(gbc->memory.oam));
+	hash = hash_bytes(hash, gbc->memory.hram, sizeof(gbc->memory.hram));
+	hash = hash_bytes(hash, gbc->memory.ioreg, sizeof(gbc->memory.ioreg));
+	hash = hash_bytes(hash, &gbc->ppu.frames_hash, sizeof(gbc->ppu.frames_hash));
+	const struct gbcc_frame *frame = gbc->ppu.screen.frame;
+	if (gbc->indexed_output) {
+		hash = hash_bytes(hash, frame->indices, sizeof(frame->indices));
+		hash = hash_bytes(hash, frame->line_palette, sizeof(frame->line_palette));
+		hash = hash_bytes(hash, frame->palettes, frame->n_palettes * sizeof(frame->palettes[0]));
+	} else {
+		hash = hash_bytes(hash, frame->colours, sizeof(frame->colours));
+	}
+	if (gbc->cart.ram_size > 0) {
+		hash = hash_bytes(hash, gbc->cart.ram, gbc->cart.ram_size);
+	}
+	return hash;
+}
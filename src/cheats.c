@@ -1,6 +1,8 @@
 #include "cheats.h"
 #include "core.h"
+#include "bit_utils.h"
 #include "debug.h"
+#include "icache.h"
 #include "nelem.h"
 #include <stdio.h>
 #include <string.h>
@@ -8,6 +10,7 @@
 static struct gbcc_gamegenie_cheat parse_gamegenie_code(const char *code);
 static struct gbcc_gameshark_cheat parse_gameshark_code(const char *code);
 static uint8_t hex2int(char c);
+static uint8_t genie_hash(uint16_t addr, uint8_t old_data);
 
 void gbcc_cheats_add_fuzzy(struct gbcc_core *gbc, const char *code)
 {	
@@ -39,8 +42,19 @@ void gbcc_cheats_add_gamegenie(struct gbcc_core *gbc, const char *code)
 	if (n >= N_ELEM(gbc->cheats.gamegenie)) {
 		return;
 	}
-	gbc->cheats.gamegenie[n] = parse_gamegenie_code(code);
+	struct gbcc_gamegenie_cheat cheat = parse_gamegenie_code(code);
+	gbc->cheats.gamegenie[n] = cheat;
 	gbc->cheats.num_genie_cheats = n+1;
+	if (cheat.address >= ROMX_END) {
+		return;
+	}
+
+	gbc->cheats.genie_map[cheat.address / 8] |= bit(cheat.address % 8);
+	uint8_t h = genie_hash(cheat.address, cheat.old_data);
+	while (gbc->cheats.genie_hash[h] != 0) {
+		h = (h + 1) & (GBCC_CHEATS_GENIE_HASH_SIZE - 1);
+	}
+	gbc->cheats.genie_hash[h] = n + 1;
 }
 
 void gbcc_cheats_add_gameshark(struct gbcc_core *gbc, const char *code)
@@ -53,17 +67,37 @@ void gbcc_cheats_add_gameshark(struct gbcc_core *gbc, const char *code)
 	gbc->cheats.num_shark_cheats = n+1;
 }
 
+/*
+ * Called on every ROM read while cheats are enabled, so addresses without a
+ * code only cost a single bit test.
+ */
 uint8_t gbcc_cheats_gamegenie_read(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 {
-	for (int i = 0; i < gbc->cheats.num_genie_cheats; i++) {
-		struct gbcc_gamegenie_cheat cheat = gbc->cheats.gamegenie[i];
+	if (!check_bit(gbc->cheats.genie_map[addr / 8], addr % 8)) {
+		return val;
+	}
+	uint8_t h = genie_hash(addr, val);
+	while (gbc->cheats.genie_hash[h] != 0) {
+		struct gbcc_gamegenie_cheat cheat = gbc->cheats.gamegenie[gbc->cheats.genie_hash[h] - 1];
 		if (cheat.address == addr && cheat.old_data == val) {
 			return cheat.new_data;
 		}
+		h = (h + 1) & (GBCC_CHEATS_GENIE_HASH_SIZE - 1);
 	}
 	return val;
 }
 
+/* Whether any of the len bytes starting at addr might have a code on them */
+bool gbcc_cheats_gamegenie_patched(struct gbcc_core *gbc, uint16_t addr, uint8_t len)
+{
+	for (uint16_t a = addr; a < addr + len && a < ROMX_END; a++) {
+		if (check_bit(gbc->cheats.genie_map[a / 8], a % 8)) {
+			return true;
+		}
+	}
+	return false;
+}
+
 void gbcc_cheats_gameshark_update(struct gbcc_core *gbc)
 {
 	for (int i = 0; i < gbc->cheats.num_shark_cheats; i++) {
@@ -75,6 +109,7 @@ void gbcc_cheats_gameshark_update(struct gbcc_core *gbc)
 			size_t addr = cheat.ram_bank * SRAM_SIZE + (cheat.address - SRAM_START);
 			gbc->cart.ram[addr] = cheat.new_data;
 		} else if (cheat.address >= WRAM0_START && cheat.address < WRAMX_END) {
+			gbcc_icache_ram_write(gbc, cheat.address);
 			if (cheat.address < WRAMX_START) {
 				gbc->memory.wram0[cheat.address - WRAM0_START] = cheat.new_data;
 			} else {
@@ -114,6 +149,12 @@ struct gbcc_gameshark_cheat parse_gameshark_code(const char code[8])
 	return cheat;
 }
 
+uint8_t genie_hash(uint16_t addr, uint8_t old_data)
+{
+	uint16_t h = (uint16_t)(addr ^ (addr >> 6u) ^ (old_data << 3u) ^ old_data);
+	return (uint8_t)(h & (GBCC_CHEATS_GENIE_HASH_SIZE - 1));
+}
+
 uint8_t hex2int(char c)
 {
 	if (c >= 'A' && c <= 'F') {
@@ -12,6 +12,9 @@ struct gbcc_gamegenie_cheat {
 	uint8_t new_data;
 };
 
+/* Must be a power of two, and more than the maximum number of codes */
+#define GBCC_CHEATS_GENIE_HASH_SIZE 64u
+
 struct gbcc_gameshark_cheat {
 	uint16_t address;
 	uint8_t ram_bank;
@@ -22,6 +25,7 @@ void gbcc_cheats_add_fuzzy(struct gbcc_core *gbc, const char *code);
 void gbcc_cheats_add_gamegenie(struct gbcc_core *gbc, const char *code);
 void gbcc_cheats_add_gameshark(struct gbcc_core *gbc, const char *code);
 uint8_t gbcc_cheats_gamegenie_read(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+bool gbcc_cheats_gamegenie_patched(struct gbcc_core *gbc, uint16_t addr, uint8_t len);
 void gbcc_cheats_gameshark_update(struct gbcc_core *gbc);
 
 #endif /* GBCC_CHEATS_H */
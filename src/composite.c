@@ -0,0 +1,347 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "core.h"
+#include "bit_utils.h"
+#include "composite.h"
+#include "ppu.h"
+#include <stdbool.h>
+
+#if !defined(GBCC_NO_SIMD) && defined(__SSE2__)
+#define COMPOSITE_SSE2
+#include <emmintrin.h>
+#elif !defined(GBCC_NO_SIMD) && defined(__ARM_NEON)
+#define COMPOSITE_NEON
+#include <arm_neon.h>
+#endif
+
+/* Pixels done at a time by the vector versions */
+#define VECTOR_WIDTH 16
+
+#if defined(COMPOSITE_SSE2)
+static void composite_sse2(struct gbcc_core *gbc, uint32_t *line);
+static void composite_indexed_sse2(struct gbcc_core *gbc, uint8_t *line);
+static void layer_masks(const struct gbcc_core *gbc, int x, __m128i *window, __m128i *sprite);
+static __m128i has_attr(__m128i attr, uint8_t flag);
+static __m128i blend(__m128i mask, __m128i a, __m128i b);
+static void widen_mask(__m128i mask, __m128i out[4]);
+#elif defined(COMPOSITE_NEON)
+static void composite_neon(struct gbcc_core *gbc, uint32_t *line);
+static void composite_indexed_neon(struct gbcc_core *gbc, uint8_t *line);
+static void layer_masks(const struct gbcc_core *gbc, int x, uint8x16_t *window, uint8x16_t *sprite);
+static uint32x4_t widen_mask(uint8x16_t mask, int n);
+#else
+enum layer { LAYER_BACKGROUND, LAYER_WINDOW, LAYER_SPRITE };
+
+static void composite_scalar(struct gbcc_core *gbc, uint32_t *line);
+static void composite_indexed_scalar(struct gbcc_core *gbc, uint8_t *line);
+static enum layer top_layer(const struct gbcc_core *gbc, uint8_t x);
+#endif
+
+/*
+ * Composite the line according to various attributes. In order of
+ * increasing priority, these are:
+ * ob_attr & ATTR_PRIORITY: if set, draw sprites below background
+ * 			    colours 1-3
+ * (win|bg)_attr & ATTR_PRIORITY: same as above
+ * bit(ppu->lcdc, 0): TODO: different for DMG & GBC
+ *
+ * Put another way, a sprite pixel is shown unless it's hidden behind the
+ * window (if either has priority), or behind a background colour 1-3 (again
+ * if either has priority). Otherwise the window is shown where it's drawn,
+ * and the background everywhere else.
+ */
+void gbcc_composite_line(struct gbcc_core *gbc, uint32_t *line)
+{
+#if defined(COMPOSITE_SSE2)
+	composite_sse2(gbc, line);
+#elif defined(COMPOSITE_NEON)
+	composite_neon(gbc, line);
+#else
+	composite_scalar(gbc, line);
+#endif
+}
+
+/* The same, but with colour table indices, for indexed_output */
+void gbcc_composite_line_indexed(struct gbcc_core *gbc, uint8_t *line)
+{
+#if defined(COMPOSITE_SSE2)
+	composite_indexed_sse2(gbc, line);
+#elif defined(COMPOSITE_NEON)
+	composite_indexed_neon(gbc, line);
+#else
+	composite_indexed_scalar(gbc, line);
+#endif
+}
+
+#if defined(COMPOSITE_SSE2)
+
+void composite_sse2(struct gbcc_core *gbc, uint32_t *line)
+{
+	const struct ppu *ppu = &gbc->ppu;
+	const __m128i white = _mm_set1_epi32(-1);
+
+	for (int x = 0; x < GBC_SCREEN_WIDTH; x += VECTOR_WIDTH) {
+		__m128i window_mask;
+		__m128i sprite_mask;
+		__m128i window_masks[4];
+		__m128i sprite_masks[4];
+		layer_masks(gbc, x, &window_mask, &sprite_mask);
+		widen_mask(window_mask, window_masks);
+		widen_mask(sprite_mask, sprite_masks);
+
+		for (int i = 0; i < 4; i++) {
+			int offset = x + 4 * i;
+			__m128i colour = white;
+			if (!gbc->hide_background) {
+				colour = _mm_loadu_si128((const __m128i *)&ppu->bg_line.colour[offset]);
+			}
+			__m128i win = _mm_loadu_si128((const __m128i *)&ppu->window_line.colour[offset]);
+			__m128i ob = _mm_loadu_si128((const __m128i *)&ppu->sprite_line.colour[offset]);
+			colour = blend(window_masks[i], win, colour);
+			colour = blend(sprite_masks[i], ob, colour);
+			_mm_storeu_si128((__m128i *)&line[offset], colour);
+		}
+	}
+}
+
+void composite_indexed_sse2(struct gbcc_core *gbc, uint8_t *line)
+{
+	const struct ppu *ppu = &gbc->ppu;
+	const __m128i white = _mm_set1_epi8(GBCC_COLOUR_WHITE);
+
+	for (int x = 0; x < GBC_SCREEN_WIDTH; x += VECTOR_WIDTH) {
+		__m128i window_mask;
+		__m128i sprite_mask;
+		layer_masks(gbc, x, &window_mask, &sprite_mask);
+
+		__m128i index = white;
+		if (!gbc->hide_background) {
+			index = _mm_loadu_si128((const __m128i *)&ppu->bg_line.index[x]);
+		}
+		__m128i win = _mm_loadu_si128((const __m128i *)&ppu->window_line.index[x]);
+		__m128i ob = _mm_loadu_si128((const __m128i *)&ppu->sprite_line.index[x]);
+		index = blend(window_mask, win, index);
+		index = blend(sprite_mask, ob, index);
+		_mm_storeu_si128((__m128i *)&line[x], index);
+	}
+}
+
+/* Byte masks of where the window, and where sprites, are shown */
+void layer_masks(const struct gbcc_core *gbc, int x, __m128i *window, __m128i *sprite)
+{
+	const struct ppu *ppu = &gbc->ppu;
+	const __m128i show_window = _mm_set1_epi8(gbc->hide_window ? 0 : -1);
+	const __m128i show_sprites = _mm_set1_epi8(gbc->hide_sprites ? 0 : -1);
+
+	__m128i bg_attr = _mm_loadu_si128((const __m128i *)&ppu->bg_line.attr[x]);
+	__m128i win_attr = _mm_loadu_si128((const __m128i *)&ppu->window_line.attr[x]);
+	__m128i ob_attr = _mm_loadu_si128((const __m128i *)&ppu->sprite_line.attr[x]);
+
+	__m128i win_drawn = has_attr(win_attr, ATTR_DRAWN);
+	__m128i ob_priority = has_attr(ob_attr, ATTR_PRIORITY);
+	__m128i bg_opaque = _mm_andnot_si128(
+			has_attr(bg_attr, ATTR_COLOUR0),
+			has_attr(bg_attr, ATTR_DRAWN));
+	__m128i behind_window = _mm_and_si128(win_drawn,
+			_mm_or_si128(has_attr(win_attr, ATTR_PRIORITY), ob_priority));
+	__m128i behind_bg = _mm_and_si128(bg_opaque,
+			_mm_or_si128(has_attr(bg_attr, ATTR_PRIORITY), ob_priority));
+
+	*window = _mm_and_si128(win_drawn, show_window);
+	*sprite = _mm_andnot_si128(_mm_or_si128(behind_window, behind_bg),
+			_mm_and_si128(has_attr(ob_attr, ATTR_DRAWN), show_sprites));
+}
+
+/* All ones in each byte of attr which has flag set */
+__m128i has_attr(__m128i attr, uint8_t flag)
+{
+	__m128i f = _mm_set1_epi8((char)flag);
+	return _mm_cmpeq_epi8(_mm_and_si128(attr, f), f);
+}
+
+/* a where mask is set, otherwise b */
+__m128i blend(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* Stretch a mask of 16 bytes into 4 masks of 4 32-bit lanes */
+void widen_mask(__m128i mask, __m128i out[4])
+{
+	__m128i lo = _mm_unpacklo_epi8(mask, mask);
+	__m128i hi = _mm_unpackhi_epi8(mask, mask);
+	out[0] = _mm_unpacklo_epi16(lo, lo);
+	out[1] = _mm_unpackhi_epi16(lo, lo);
+	out[2] = _mm_unpacklo_epi16(hi, hi);
+	out[3] = _mm_unpackhi_epi16(hi, hi);
+}
+
+#elif defined(COMPOSITE_NEON)
+
+void composite_neon(struct gbcc_core *gbc, uint32_t *line)
+{
+	const struct ppu *ppu = &gbc->ppu;
+	const uint32x4_t white = vdupq_n_u32(0xFFFFFFFFu);
+
+	for (int x = 0; x < GBC_SCREEN_WIDTH; x += VECTOR_WIDTH) {
+		uint8x16_t window_mask;
+		uint8x16_t sprite_mask;
+		layer_masks(gbc, x, &window_mask, &sprite_mask);
+
+		for (int i = 0; i < 4; i++) {
+			int offset = x + 4 * i;
+			uint32x4_t colour = white;
+			if (!gbc->hide_background) {
+				colour = vld1q_u32(&ppu->bg_line.colour[offset]);
+			}
+			colour = vbslq_u32(widen_mask(window_mask, i), vld1q_u32(&ppu->window_line.colour[offset]), colour);
+			colour = vbslq_u32(widen_mask(sprite_mask, i), vld1q_u32(&ppu->sprite_line.colour[offset]), colour);
+			vst1q_u32(&line[offset], colour);
+		}
+	}
+}
+
+void composite_indexed_neon(struct gbcc_core *gbc, uint8_t *line)
+{
+	const struct ppu *ppu = &gbc->ppu;
+	const uint8x16_t white = vdupq_n_u8(GBCC_COLOUR_WHITE);
+
+	for (int x = 0; x < GBC_SCREEN_WIDTH; x += VECTOR_WIDTH) {
+		uint8x16_t window_mask;
+		uint8x16_t sprite_mask;
+		layer_masks(gbc, x, &window_mask, &sprite_mask);
+
+		uint8x16_t index = white;
+		if (!gbc->hide_background) {
+			index = vld1q_u8(&ppu->bg_line.index[x]);
+		}
+		index = vbslq_u8(window_mask, vld1q_u8(&ppu->window_line.index[x]), index);
+		index = vbslq_u8(sprite_mask, vld1q_u8(&ppu->sprite_line.index[x]), index);
+		vst1q_u8(&line[x], index);
+	}
+}
+
+/* Byte masks of where the window, and where sprites, are shown */
+void layer_masks(const struct gbcc_core *gbc, int x, uint8x16_t *window, uint8x16_t *sprite)
+{
+	const struct ppu *ppu = &gbc->ppu;
+	const uint8x16_t drawn = vdupq_n_u8(ATTR_DRAWN);
+	const uint8x16_t colour0 = vdupq_n_u8(ATTR_COLOUR0);
+	const uint8x16_t priority = vdupq_n_u8(ATTR_PRIORITY);
+	const uint8x16_t show_window = vdupq_n_u8(gbc->hide_window ? 0 : 0xFFu);
+	const uint8x16_t show_sprites = vdupq_n_u8(gbc->hide_sprites ? 0 : 0xFFu);
+
+	uint8x16_t bg_attr = vld1q_u8(&ppu->bg_line.attr[x]);
+	uint8x16_t win_attr = vld1q_u8(&ppu->window_line.attr[x]);
+	uint8x16_t ob_attr = vld1q_u8(&ppu->sprite_line.attr[x]);
+
+	uint8x16_t win_drawn = vtstq_u8(win_attr, drawn);
+	uint8x16_t ob_priority = vtstq_u8(ob_attr, priority);
+	uint8x16_t bg_opaque = vbicq_u8(vtstq_u8(bg_attr, drawn), vtstq_u8(bg_attr, colour0));
+	uint8x16_t behind_window = vandq_u8(win_drawn,
+			vorrq_u8(vtstq_u8(win_attr, priority), ob_priority));
+	uint8x16_t behind_bg = vandq_u8(bg_opaque,
+			vorrq_u8(vtstq_u8(bg_attr, priority), ob_priority));
+
+	*window = vandq_u8(win_drawn, show_window);
+	*sprite = vbicq_u8(
+			vandq_u8(vtstq_u8(ob_attr, drawn), show_sprites),
+			vorrq_u8(behind_window, behind_bg));
+}
+
+/* Stretch bytes 4n to 4n + 3 of a mask into 32-bit lanes */
+uint32x4_t widen_mask(uint8x16_t mask, int n)
+{
+	int8x16_t m = vreinterpretq_s8_u8(mask);
+	int16x8_t half = vmovl_s8((n < 2) ? vget_low_s8(m) : vget_high_s8(m));
+	int32x4_t quarter = vmovl_s16((n % 2 == 0) ? vget_low_s16(half) : vget_high_s16(half));
+	return vreinterpretq_u32_s32(quarter);
+}
+
+#else
+
+void composite_scalar(struct gbcc_core *gbc, uint32_t *line)
+{
+	const struct ppu *ppu = &gbc->ppu;
+	for (uint8_t x = 0; x < GBC_SCREEN_WIDTH; x++) {
+		switch (top_layer(gbc, x)) {
+			case LAYER_BACKGROUND:
+				line[x] = gbc->hide_background ? 0xFFFFFFFFu : ppu->bg_line.colour[x];
+				break;
+			case LAYER_WINDOW:
+				line[x] = ppu->window_line.colour[x];
+				break;
+			case LAYER_SPRITE:
+				line[x] = ppu->sprite_line.colour[x];
+				break;
+		}
+	}
+}
+
+void composite_indexed_scalar(struct gbcc_core *gbc, uint8_t *line)
+{
+	const struct ppu *ppu = &gbc->ppu;
+	for (uint8_t x = 0; x < GBC_SCREEN_WIDTH; x++) {
+		switch (top_layer(gbc, x)) {
+			case LAYER_BACKGROUND:
+				line[x] = gbc->hide_background ? GBCC_COLOUR_WHITE : ppu->bg_line.index[x];
+				break;
+			case LAYER_WINDOW:
+				line[x] = ppu->window_line.index[x];
+				break;
+			case LAYER_SPRITE:
+				line[x] = ppu->sprite_line.index[x];
+				break;
+		}
+	}
+}
+
+/* Which of the line buffers is shown at x */
+enum layer top_layer(const struct gbcc_core *gbc, uint8_t x)
+{
+	const struct ppu *ppu = &gbc->ppu;
+	uint8_t bg_attr = ppu->bg_line.attr[x];
+	uint8_t win_attr = ppu->window_line.attr[x];
+	uint8_t ob_attr = ppu->sprite_line.attr[x];
+	enum layer top = LAYER_BACKGROUND;
+
+	if (win_attr & ATTR_DRAWN && !gbc->hide_window) {
+		top = LAYER_WINDOW;
+		if (win_attr & ATTR_PRIORITY && !(win_attr & ATTR_COLOUR0)) {
+			return top;
+		}
+	}
+	if (!(ob_attr & ATTR_DRAWN)) {
+		return top;
+	}
+	if ((win_attr & ATTR_DRAWN)) {
+		if (win_attr & ATTR_PRIORITY) {
+			return top;
+		}
+		if (ob_attr & ATTR_PRIORITY) {
+			return top;
+		}
+	}
+	if ((bg_attr & ATTR_DRAWN)) {
+		if (bg_attr & ATTR_PRIORITY && !(bg_attr & ATTR_COLOUR0)) {
+			return top;
+		}
+		if (!(bg_attr & ATTR_COLOUR0) && (ob_attr & ATTR_PRIORITY)) {
+			return top;
+		}
+	}
+	if (gbc->hide_sprites) {
+		return top;
+	}
+	return LAYER_SPRITE;
+}
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef GBCC_COMPOSITE_H
+#define GBCC_COMPOSITE_H
+
+#include <stdint.h>
+
+/*
+ * Combining the background, window & sprite line buffers into the final
+ * colours (or colour table indices) of a line.
+ *
+ * Where the compiler targets SSE2 (all x86-64) or NEON (all AArch64), 16
+ * pixels are done at a time, otherwise a plain loop is used. Define
+ * GBCC_NO_SIMD to force the plain loop; testing/simd_check.sh uses this to
+ * check the others against it.
+ */
+
+struct gbcc_core;
+
+void gbcc_composite_line(struct gbcc_core *gbc, uint32_t *line);
+void gbcc_composite_line_indexed(struct gbcc_core *gbc, uint8_t *line);
+
+#endif /* GBCC_COMPOSITE_H */
@@ -11,7 +11,9 @@
 #include "core.h"
 #include "config.h"
 #include "debug.h"
+#include "idle.h"
 #include "nelem.h"
+#include "ppu.h"
 #include "save.h"
 #include "window.h"
 #include <ctype.h>
@@ -188,6 +190,11 @@ void gbcc_load_config(struct gbcc *gbc, const char *filename)
 		free(option_stripped);
 	}
 
+	/* The SDL frontend loads the ROM before reading the config */
+	if (gbc->core.initialised) {
+		gbcc_idle_skip_apply(&gbc->core);
+	}
+
 CLEANUP_ALL:
 	free(config_copy);
 CLEANUP_CONFIG:
@@ -230,17 +237,45 @@ bool parse_option(struct gbcc *gbc, size_t lineno, const char *option, const cha
 		gbc->autosave = parse_bool(lineno, value, &err);
 	} else if (strcasecmp(option, "background") == 0) {
 		gbc->background_play = parse_bool(lineno, value, &err);
+	} else if (strcasecmp(option, "block-executor") == 0) {
+		gbc->core.block_executor = parse_bool(lineno, value, &err);
 	} else if (strcasecmp(option, "cheat") == 0) {
 		gbcc_cheats_add_fuzzy(&gbc->core, value);
 		gbc->core.cheats.enabled = true;
+	} else if (strcasecmp(option, "cycle-accurate") == 0) {
+		gbc->core.cycle_accurate = parse_bool(lineno, value, &err);
 	} else if (strcasecmp(option, "fractional") == 0) {
 		gbc->fractional_scaling = parse_bool(lineno, value, &err);
 	} else if (strcasecmp(option, "frame-blending") == 0) {
 		gbc->frame_blending = parse_bool(lineno, value, &err);
+	} else if (strcasecmp(option, "frame-skip") == 0) {
+		if (strcasecmp(value, "auto") == 0) {
+			gbc->core.frame_skip_auto = true;
+		} else {
+			errno = 0;
+			char *endptr;
+			unsigned long frames = strtoul(value, &endptr, 10);
+			if (endptr == value || *endptr != '\0') {
+				PARSE_ERROR(lineno, "Failed to parse \"%s\" as frame skip.\n", value);
+				err = true;
+			} else if (errno || frames > UINT8_MAX) {
+				PARSE_ERROR(lineno, "Frame skip \"%s\" out of range.\n", value);
+				err = true;
+			} else {
+				gbc->core.frame_skip = (uint8_t)frames;
+				gbc->core.frame_skip_auto = false;
+			}
+		}
+	} else if (strcasecmp(option, "idle-skip") == 0) {
+		gbcc_idle_skip_enable(parse_bool(lineno, value, &err));
+	} else if (strcasecmp(option, "idle-skip-exclude") == 0) {
+		gbcc_idle_skip_exclude(value);
+	} else if (strcasecmp(option, "indexed-colour") == 0) {
+		gbc->core.indexed_output = parse_bool(lineno, value, &err);
 	} else if (strcasecmp(option, "interlacing") == 0) {
 		gbc->interlacing = parse_bool(lineno, value, &err);
 	} else if (strcasecmp(option, "palette") == 0) {
-		gbc->core.ppu.palette = gbcc_get_palette(value);
+		gbcc_ppu_set_palette(&gbc->core, gbcc_get_palette(value));
 	} else if (strcasecmp(option, "shader") == 0) {
 		gbcc_window_use_shader(gbc, value);
 	} else if (strcasecmp(option, "save-dir") == 0) {
@@ -11,15 +11,20 @@
 #ifndef GBCC_CORE_H
 #define GBCC_CORE_H
 
-#define GBCC_SAVE_STATE_VERSION 8
+#define GBCC_SAVE_STATE_VERSION 29
 
 #include "apu.h"
 #include "cheats.h"
 #include "constants.h"
 #include "cpu.h"
+#include "icache.h"
+#include "idle.h"
 #include "mbc.h"
 #include "ppu.h"
 #include "printer.h"
+#include "scheduler.h"
+#include "tile_cache.h"
+#include "timer.h"
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -40,6 +45,8 @@ struct gbcc_core {
 	struct cpu cpu;
 	struct apu apu;
 	struct ppu ppu;
+	struct gbcc_scheduler scheduler;
+	struct gbcc_timer timer;
 
 	enum CART_MODE mode;
 	struct {
@@ -48,13 +55,14 @@ struct gbcc_core {
 		uint16_t length;
 		uint16_t to_copy;
 		bool hblank;
+		bool stale;	/* HDMA1-5 need updating from the above */
 	} hdma;
 
 	/* Memory map */
 	struct {
 		/* GBC areas */
-		uint8_t *rom0;	/* Non-switchable ROM */
-		uint8_t *romx;	/* Switchable ROM */
+		const uint8_t *rom0;	/* Non-switchable ROM */
+		const uint8_t *romx;	/* Switchable ROM */
 		uint8_t *vram;	/* VRAM (switchable in GBC mode) */
 		uint8_t *sram;	/* Cartridge RAM */
 		uint8_t *wram0;	/* Non-switchable Work RAM */
@@ -65,16 +73,31 @@ struct gbcc_core {
 		uint8_t ioreg[IOREG_SIZE];	/* I/O Registers */
 		uint8_t hram[HRAM_SIZE];	/* Internal CPU RAM */
 		uint8_t iereg;	/* Interrupt enable flags */
+		/*
+		 * Where each 256-byte page of the address space currently
+		 * lives, or NULL if it has to go through a handler.
+		 */
+		const uint8_t *read_map[0x100];
+		uint8_t *write_map[0x100];
 		/* Emulator areas */
 		uint8_t wram_bank[8][WRAM0_SIZE];	/* Actual location of WRAM */
 		uint8_t vram_bank[2][VRAM_SIZE]; 	/* Actual location of VRAM */
 	} memory;
 
+	/* Decoded instructions */
+	struct gbcc_icache *icache;
+
+	/* Decoded VRAM tiles */
+	struct gbcc_tile_cache *tile_cache;
+
+	/* Idle loop detection */
+	struct gbcc_idle_loop idle;
+
 	/* Cartridge data & flags */
 	struct {
 		struct gbcc_mbc mbc;
 		const char *filename;
-		uint8_t *rom;
+		const uint8_t *rom;
 		size_t rom_size;
 		size_t rom_banks;
 		uint8_t *ram;
@@ -116,6 +139,10 @@ struct gbcc_core {
 	struct {
 		struct gbcc_gamegenie_cheat gamegenie[32];
 		struct gbcc_gameshark_cheat gameshark[32];
+		/* One bit per ROM address with a Game Genie code on it */
+		uint8_t genie_map[ROMX_END / 8];
+		/* Game Genie codes (index + 1), hashed by address & old data */
+		uint8_t genie_hash[GBCC_CHEATS_GENIE_HASH_SIZE];
 		uint8_t num_genie_cheats;
 		uint8_t num_shark_cheats;
 		bool enabled;
@@ -123,6 +150,12 @@ struct gbcc_core {
 
 	/* Settings */
 	bool sync_to_video;
+	bool cycle_accurate;
+	bool block_executor;
+	bool idle_skip;
+	uint8_t frame_skip;	/* Frames left undrawn after each one drawn */
+	bool frame_skip_auto;	/* Skip frames the frontend won't present */
+	bool indexed_output;	/* Draw colour table indices, not colours */
 	bool hide_background;
 	bool hide_window;
 	bool hide_sprites;
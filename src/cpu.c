@@ -15,32 +15,91 @@
 #include "debug.h"
 #include "gbcc.h"
 #include "hdma.h"
+#include "icache.h"
+#include "idle.h"
 #include "memory.h"
 #include "ops.h"
 #include "ppu.h"
+#include "scheduler.h"
+#include "timer.h"
 #include <stdio.h>
 #include <sys/time.h>
 #include <time.h>
 
-static inline void clock_div(struct gbcc_core *gbc);
 static void check_interrupts(struct gbcc_core *gbc);
 static inline void cpu_clock(struct gbcc_core *gbc);
+static bool is_ram(uint16_t addr);
+static bool can_execute_whole(struct gbcc_core *gbc);
+static bool access_is_safe(struct gbcc_core *gbc, uint8_t opcode, uint8_t cb_opcode);
+static uint8_t execute_whole(struct gbcc_core *gbc);
+static uint8_t execute_block(struct gbcc_core *gbc, uint8_t opcode, uint8_t cycles);
+static uint8_t block_limit(struct gbcc_core *gbc);
+static uint64_t interrupt_budget(struct gbcc_core *gbc);
+static uint8_t fetch_opcode(struct gbcc_core *gbc);
+static uint8_t fetch_cached(struct gbcc_core *gbc, const struct gbcc_icache_entry *entry);
+static uint32_t halted_cycles(struct gbcc_core *gbc, uint32_t max_cycles);
+static uint32_t idle_loop_cycles(struct gbcc_core *gbc, uint32_t max_cycles);
+static uint32_t remaining_cycles(struct gbcc_core *gbc, uint32_t max_cycles);
+static uint32_t quiet_cycles(struct gbcc_core *gbc, uint32_t max_cycles);
+static void fast_forward(struct gbcc_core *gbc, uint32_t cycles);
 
 /* TODO: Check order of all of these */
 ANDROID_INLINE
 void gbcc_emulate_cycle(struct gbcc_core *gbc)
 {
+	struct gbcc_scheduler *sched = &gbc->scheduler;
+	/* Advance to the next even half-clock */
+	sched->time = (sched->time | 1u) + 1u;
 	check_interrupts(gbc);
-	gbcc_apu_clock(gbc);
-	gbcc_ppu_clock(gbc);
+	if (sched->time >= sched->next) {
+		if (sched->time >= sched->events[GBCC_EVENT_APU]) {
+			gbcc_apu_event(gbc);
+		}
+		if (sched->time >= sched->events[GBCC_EVENT_PPU]) {
+			gbcc_ppu_event(gbc);
+		}
+	}
 	cpu_clock(gbc);
-	clock_div(gbc);
-	gbcc_link_cable_clock(gbc);
+	if (sched->time >= sched->events[GBCC_EVENT_TIMER]) {
+		gbcc_timer_event(gbc);
+	}
+	if (sched->time >= sched->events[GBCC_EVENT_SERIAL]) {
+		gbcc_link_cable_clock(gbc);
+	}
 	if (gbc->cpu.double_speed) {
+		sched->time++;
 		cpu_clock(gbc);
-		clock_div(gbc);
-		gbcc_link_cable_clock(gbc);
+		if (sched->time >= sched->events[GBCC_EVENT_TIMER]) {
+			gbcc_timer_event(gbc);
+		}
+		if (sched->time >= sched->events[GBCC_EVENT_SERIAL]) {
+			gbcc_link_cable_clock(gbc);
+		}
+	}
+}
+
+/*
+ * Emulate at most max_cycles cycles, and return how many were emulated.
+ * Normally this is just one, but while the CPU is halted or stopped, stuck in
+ * an idle loop, or counting off the rest of an instruction it has already
+ * executed, nothing can happen until the next scheduled event or timer
+ * overflow, so we can skip straight there.
+ */
+uint32_t gbcc_emulate_cycles(struct gbcc_core *gbc, uint32_t max_cycles)
+{
+	uint32_t cycles = halted_cycles(gbc, max_cycles);
+	if (cycles == 0) {
+		cycles = idle_loop_cycles(gbc, max_cycles);
+	}
+	if (cycles == 0) {
+		cycles = remaining_cycles(gbc, max_cycles);
+	}
+	if (cycles > 1) {
+		fast_forward(gbc, cycles);
+		return cycles;
 	}
+	gbcc_emulate_cycle(gbc);
+	return 1;
 }
 
 ANDROID_INLINE
@@ -63,14 +122,18 @@ void cpu_clock(struct gbcc_core *gbc)
 		}
 	}
 	if (cpu->dma.timer > 0) {
+		/* Bytes are only counted here, and copied in bulk later */
 		cpu->dma.running = true;
-		gbc->memory.oam[low_byte(cpu->dma.source)] = gbcc_memory_read(gbc, cpu->dma.source);
 		cpu->dma.timer--;
-		cpu->dma.source++;
+		if (cpu->dma.timer == 0) {
+			gbcc_memory_dma_sync(gbc);
+		}
 	} else {
 		cpu->dma.running = false;
 	}
 	if (cpu->dma.requested) {
+		/* Finish off whatever the previous DMA got through */
+		gbcc_memory_dma_sync(gbc);
 		cpu->dma.requested = false;
 		cpu->dma.timer = DMA_TIMER;
 		cpu->dma.source = cpu->dma.new_source;
@@ -79,16 +142,29 @@ void cpu_clock(struct gbcc_core *gbc)
 		gbcc_hdma_copy_chunk(gbc);
 		return;
 	}
+	if (cpu->instruction.remaining > 0) {
+		cpu->instruction.remaining--;
+		return;
+	}
 	if (!cpu->instruction.running) {
 		if (cpu->interrupt.running || (cpu->ime && cpu->interrupt.request)) {
 			INTERRUPT(gbc);
 			return;
 		}
 		//printf("%d::%04X\n", gbc->cart.mbc.romx_bank, cpu->reg.pc);
-		cpu->opcode = gbcc_fetch_instruction(gbc);
+		cpu->opcode = fetch_opcode(gbc);
 		//gbcc_print_registers(gbc);
 		//gbcc_print_op(gbc);
 		cpu->instruction.running = true;
+		if (can_execute_whole(gbc)) {
+			uint8_t opcode = cpu->opcode;
+			uint8_t cycles = execute_whole(gbc);
+			if (gbc->block_executor) {
+				cycles = execute_block(gbc, opcode, cycles);
+			}
+			cpu->instruction.remaining = (uint8_t)(cycles - 1u);
+			return;
+		}
 	}
 	if (cpu->instruction.prefix_cb) {
 		gbcc_ops[0xCB](gbc);
@@ -97,101 +173,21 @@ void cpu_clock(struct gbcc_core *gbc)
 	}
 }
 
-__attribute__((always_inline))
-void clock_div(struct gbcc_core *gbc)
+void check_interrupts(struct gbcc_core *gbc)
 {
 	struct cpu *cpu = &gbc->cpu;
-	cpu->div_timer++;
-	uint8_t tac = gbcc_memory_read_force(gbc, TAC);
-	uint16_t mask = 0;
-	switch (tac & 0x03u) {
-		/* 
-		 * TIMA register detects the falling edge of a bit in
-		 * the internal DIV timer, which is selected by TAC.
-		 */
-		case 0:
-			mask = bit16(9);
-			break;
-		case 1:
-			mask = bit16(3);
-			break;
-		case 2:
-			mask = bit16(5);
-			break;
-		case 3:
-			mask = bit16(7);
-			break;
-	}
-	/* If TAC is disabled, this will always see 0 */
-	mask *= check_bit(tac, 2);
-	bool old_bit = cpu->tac_bit;
-	cpu->tac_bit = cpu->div_timer & mask;
-	if (old_bit && !cpu->tac_bit) {
-		/* 
-		 * The selected bit was previously high, and is now low, so
-		 * the tima increment logic triggers.
-		 */
-		uint8_t tima = gbcc_memory_read(gbc, TIMA);
-		tima++;
-		if (tima == 0) {
-			/* 
-			 * TIMA overflow
-			 * Rather than being reloaded immediately, TIMA takes
-			 * 4 cycles to be reloaded, and another 4 to write, 
-			 * so we just queue it here. This also affects the
-			 * interrupt.
-			 */
-			cpu->tima_reload = 8;
-		}
-		gbcc_memory_write(gbc, TIMA, tima);
-	}
-	if (cpu->tima_reload > 0) {
-		cpu->tima_reload--;
-		if (cpu->tima_reload == 4) {
-			/*
-			 * Some more weird behaviour here: if TIMA has been
-			 * written to while this copy & interrupt are waiting,
-			 * they get cancelled, and everything proceeds as
-			 * normal.
-			 */
-			if (gbcc_memory_read(gbc, TIMA) != 0) {
-				cpu->tima_reload = 0;
-			} else {
-				gbcc_memory_copy(gbc, TMA, TIMA);
-				gbcc_memory_set_bit(gbc, IF, 2);
-			}
-		}
-		else if (cpu->tima_reload == 0) {
-			gbcc_memory_copy(gbc, TMA, TIMA);
-		}
-	}
-	if (!gbc->apu.disabled) {
-		/* APU also updates based on falling edge of DIV timer bit */
-		if (gbc->cpu.double_speed) {
-			mask = bit16(13);
-		} else {
-			mask = bit16(12);
-		}
-		old_bit = gbc->apu.div_bit;
-		gbc->apu.div_bit = cpu->div_timer & mask;
-		if (old_bit && !gbc->apu.div_bit) {
-			gbcc_apu_sequencer_clock(gbc);
-		}
+	/* Nearly always nothing to do */
+	if (!(cpu->interrupt.pending | gbc->keys.interrupt)) {
+		cpu->interrupt.request = false;
+		return;
 	}
-}
 
-void check_interrupts(struct gbcc_core *gbc)
-{
 	if (gbc->keys.interrupt) {
 		gbcc_memory_set_bit(gbc, IF, 4);
 		gbc->keys.interrupt = false;
 	}
 
-	struct cpu *cpu = &gbc->cpu;
-	uint8_t iereg = gbcc_memory_read(gbc, IE);
-	uint8_t ifreg = gbcc_memory_read(gbc, IF);
-	uint8_t interrupt = (uint8_t)(iereg & ifreg) & 0x1Fu;
-	if (interrupt) {
+	if (cpu->interrupt.pending) {
 		cpu->halt.set = false;
 		gbc->cpu.stop = false;
 		if (cpu->ime) {
@@ -202,9 +198,354 @@ void check_interrupts(struct gbcc_core *gbc)
 	}
 }
 
+bool is_ram(uint16_t addr)
+{
+	return (addr >= WRAM0_START && addr < WRAMX_END)
+		|| (addr >= HRAM_START && addr < HRAM_END);
+}
+
+/*
+ * An instruction can be executed all in one go, rather than one M-cycle at a
+ * time, if nothing else can tell when during the instruction its memory
+ * accesses happened. That means no DMA can be running, its operands must come
+ * from ROM or RAM, and any other memory it touches must be WRAM or HRAM.
+ */
+bool can_execute_whole(struct gbcc_core *gbc)
+{
+	struct cpu *cpu = &gbc->cpu;
+	if (gbc->cycle_accurate) {
+		return false;
+	}
+	if (cpu->dma.timer > 0 || cpu->dma.requested) {
+		return false;
+	}
+	if (gbc->hdma.hblank && gbc->hdma.length > 0) {
+		return false;
+	}
+	uint16_t pc = cpu->reg.pc;
+	if (pc >= ROMX_END - 1 && !(is_ram(pc) && is_ram((uint16_t)(pc + 1u)))) {
+		return false;
+	}
+	uint8_t cb_opcode = 0;
+	if (cpu->opcode == 0xCBu) {
+		cb_opcode = gbcc_memory_read(gbc, pc);
+	}
+	return access_is_safe(gbc, cpu->opcode, cb_opcode);
+}
+
+/* Whether every memory access made by an instruction is to WRAM or HRAM */
+bool access_is_safe(struct gbcc_core *gbc, uint8_t opcode, uint8_t cb_opcode)
+{
+	struct cpu *cpu = &gbc->cpu;
+	uint8_t access = gbcc_op_access[opcode];
+	if (access == GBCC_ACCESS_CB) {
+		access = (cb_opcode % 0x08u == 6) ? GBCC_ACCESS_HL : GBCC_ACCESS_NONE;
+	}
+	switch (access) {
+		case GBCC_ACCESS_NONE:
+			return true;
+		case GBCC_ACCESS_HL:
+			return is_ram(cpu->reg.hl);
+		case GBCC_ACCESS_BC:
+			return is_ram(cpu->reg.bc);
+		case GBCC_ACCESS_DE:
+			return is_ram(cpu->reg.de);
+		case GBCC_ACCESS_STACK:
+			/* Covers both pushes and pops */
+			return is_ram((uint16_t)(cpu->reg.sp - 2u))
+				&& is_ram((uint16_t)(cpu->reg.sp + 1u));
+		default:
+			return false;
+	}
+}
+
+/*
+ * Run every step of the current instruction now, and return the number of
+ * M-cycles it would have taken.
+ */
+uint8_t execute_whole(struct gbcc_core *gbc)
+{
+	struct cpu *cpu = &gbc->cpu;
+	uint8_t cycles = 0;
+	while (cpu->instruction.running) {
+		if (cpu->instruction.prefix_cb) {
+			gbcc_ops[0xCB](gbc);
+		} else {
+			gbcc_ops[cpu->opcode](gbc);
+		}
+		cycles++;
+	}
+	return cycles;
+}
+
+/*
+ * Having just executed an instruction whole, carry on through the following
+ * straight-line ROM code for as long as it's safe to, and return the total
+ * number of M-cycles taken. The CPU then sits idle for that long, while the
+ * rest of the system catches up.
+ *
+ * This is safe as long as every instruction only touches WRAM & HRAM, and no
+ * interrupt could have been serviced in between any of them. Blocks end at
+ * any jump, call, return or change to IME, so control flow is always
+ * handled one instruction at a time.
+ */
+uint8_t execute_block(struct gbcc_core *gbc, uint8_t opcode, uint8_t cycles)
+{
+	struct cpu *cpu = &gbc->cpu;
+	if (gbcc_op_ends_block[opcode] || cpu->halt.skip) {
+		return cycles;
+	}
+	/* Only worked out once the block is known to go any further */
+	int limit = -1;
+	for (;;) {
+		uint16_t pc = cpu->reg.pc;
+		if (pc >= ROMX_END) {
+			break;
+		}
+		const struct gbcc_icache_entry *entry = gbcc_icache_lookup(gbc, pc);
+		if (!entry) {
+			break;
+		}
+		opcode = entry->opcode;
+		if (!access_is_safe(gbc, opcode, entry->operands[0])) {
+			break;
+		}
+		if (limit < 0) {
+			limit = block_limit(gbc);
+		}
+		if (cycles + gbcc_op_times[opcode] > limit) {
+			break;
+		}
+		cpu->opcode = fetch_cached(gbc, entry);
+		cpu->instruction.running = true;
+		cycles += execute_whole(gbc);
+		if (gbcc_op_ends_block[opcode]) {
+			break;
+		}
+	}
+	return cycles;
+}
+
+/*
+ * The maximum number of M-cycles a block starting now can take, which is
+ * limited by the size of instruction.remaining, and by the next time an
+ * interrupt could be requested.
+ */
+uint8_t block_limit(struct gbcc_core *gbc)
+{
+	struct cpu *cpu = &gbc->cpu;
+	uint8_t limit = UINT8_MAX;
+	bool ime = cpu->ime
+		|| (cpu->ime_timer.timer > 0 && cpu->ime_timer.target_state);
+	if (!ime) {
+		return limit;
+	}
+	uint64_t ticks_per_cycle = cpu->double_speed ? 4 : 8;
+	uint64_t max_cycles = interrupt_budget(gbc) / ticks_per_cycle;
+	if (max_cycles < limit) {
+		limit = (uint8_t)max_cycles;
+	}
+	return limit;
+}
+
+/*
+ * Number of half-clocks from now before any enabled interrupt could be
+ * requested. Only the PPU, timer and serial port can do so without the CPU
+ * touching IO registers; the joypad interrupt is asynchronous anyway.
+ */
+uint64_t interrupt_budget(struct gbcc_core *gbc)
+{
+	struct gbcc_scheduler *sched = &gbc->scheduler;
+	uint8_t iereg = gbcc_memory_read_force(gbc, IE);
+	if (gbc->cpu.interrupt.pending) {
+		/* Already pending, waiting for IME */
+		return 0;
+	}
+	uint64_t next = GBCC_SCHEDULER_NEVER;
+	if (iereg & 0x03u) {
+		next = sched->events[GBCC_EVENT_PPU];
+	}
+	if ((iereg & 0x08u) && sched->events[GBCC_EVENT_SERIAL] < next) {
+		next = sched->events[GBCC_EVENT_SERIAL];
+	}
+	/* This may just be the APU frame sequencer, but that's rare enough */
+	if ((iereg & 0x04u) && sched->events[GBCC_EVENT_TIMER] < next) {
+		next = sched->events[GBCC_EVENT_TIMER];
+	}
+	return (next > sched->time) ? next - sched->time : 0;
+}
+
+/*
+ * Fetch the next opcode, using the instruction cache if possible. In that
+ * case, the operands are read at the same time, and later calls to
+ * gbcc_fetch_instruction() return them from there.
+ */
+uint8_t fetch_opcode(struct gbcc_core *gbc)
+{
+	struct cpu *cpu = &gbc->cpu;
+	cpu->instruction.prefetched = 0;
+	if (gbc->cycle_accurate || cpu->halt.skip) {
+		return gbcc_fetch_instruction(gbc);
+	}
+	const struct gbcc_icache_entry *entry = gbcc_icache_lookup(gbc, cpu->reg.pc);
+	if (!entry) {
+		return gbcc_fetch_instruction(gbc);
+	}
+	return fetch_cached(gbc, entry);
+}
+
+/* Fetch the instruction at pc from its (already looked up) cache entry */
+uint8_t fetch_cached(struct gbcc_core *gbc, const struct gbcc_icache_entry *entry)
+{
+	struct cpu *cpu = &gbc->cpu;
+	cpu->reg.pc++;
+	/* Stored in reverse order, so they can be popped off the end */
+	cpu->instruction.prefetched = entry->length - 1u;
+	for (uint8_t i = 0; i < cpu->instruction.prefetched; i++) {
+		cpu->instruction.operands[cpu->instruction.prefetched - 1u - i] = entry->operands[i];
+	}
+	return entry->opcode;
+}
+
+/*
+ * Once an instruction (or block) has been executed all at once, the CPU just
+ * counts off the M-cycles it should have taken. Returns the number of cycles
+ * (up to max_cycles) before it fetches the next one, if nothing else can
+ * happen in the meantime.
+ */
+uint32_t remaining_cycles(struct gbcc_core *gbc, uint32_t max_cycles)
+{
+	struct cpu *cpu = &gbc->cpu;
+	if (cpu->instruction.remaining == 0 || cpu->instruction.running) {
+		return 0;
+	}
+	if (cpu->halt.set || cpu->stop) {
+		return 0;
+	}
+	if (cpu->ime_timer.timer > 0 || cpu->dma.timer > 0 || cpu->dma.running
+			|| cpu->dma.requested || gbc->hdma.to_copy > 0) {
+		return 0;
+	}
+	/* Stop short of the CPU clock which fetches the next instruction */
+	uint32_t clocks = 4u * cpu->instruction.remaining + 3u - cpu->clock;
+	uint32_t cycles = cpu->double_speed ? clocks / 2u : clocks;
+	if (cycles < max_cycles) {
+		max_cycles = cycles;
+	}
+	return quiet_cycles(gbc, max_cycles);
+}
+
+/*
+ * The number of cycles (up to max_cycles) for which the CPU is guaranteed to
+ * stay halted, and nothing other than the clocks and DIV will change.
+ */
+uint32_t halted_cycles(struct gbcc_core *gbc, uint32_t max_cycles)
+{
+	struct cpu *cpu = &gbc->cpu;
+	if (gbc->cycle_accurate || cpu->instruction.running) {
+		return 0;
+	}
+	if (!(cpu->halt.set || cpu->stop)) {
+		return 0;
+	}
+	return quiet_cycles(gbc, max_cycles);
+}
+
+/*
+ * If the CPU is going round an idle loop, the number of cycles (up to
+ * max_cycles) worth of whole iterations that can be skipped before anything
+ * the loop reads could change.
+ */
+uint32_t idle_loop_cycles(struct gbcc_core *gbc, uint32_t max_cycles)
+{
+	struct cpu *cpu = &gbc->cpu;
+	if (gbc->cycle_accurate || !gbc->idle_skip) {
+		return 0;
+	}
+	if (cpu->instruction.running || cpu->instruction.remaining > 0) {
+		return 0;
+	}
+	/* Only check once per instruction, on the cycle it's fetched in */
+	uint8_t clocks_per_cycle = cpu->double_speed ? 2 : 1;
+	if (cpu->clock + clocks_per_cycle < 4) {
+		return 0;
+	}
+	if (cpu->halt.set || cpu->halt.skip || cpu->stop || cpu->interrupt.running) {
+		return 0;
+	}
+	if (cpu->ime_timer.timer > 0 || cpu->dma.timer > 0 || cpu->dma.requested) {
+		return 0;
+	}
+	if (gbc->hdma.to_copy > 0) {
+		return 0;
+	}
+	uint8_t period = gbcc_idle_loop_check(gbc);
+	if (period == 0) {
+		return 0;
+	}
+	uint32_t iteration = 4u * period / clocks_per_cycle;
+	uint32_t cycles = quiet_cycles(gbc, max_cycles);
+	cycles -= cycles % iteration;
+	gbc->idle.skipped += cycles;
+	return cycles;
+}
+
+/*
+ * The number of cycles (up to max_cycles) before the next scheduled event or
+ * interrupt, which includes TIMA overflows and APU frame sequencer clocks.
+ * Until then, only the clocks, DIV and TIMA change by themselves, and the
+ * timer works those out when they're read.
+ */
+uint32_t quiet_cycles(struct gbcc_core *gbc, uint32_t max_cycles)
+{
+	struct cpu *cpu = &gbc->cpu;
+	struct gbcc_scheduler *sched = &gbc->scheduler;
+	if (gbc->keys.interrupt || cpu->interrupt.pending) {
+		return 0;
+	}
+
+	/* Stop before the cycle containing the next event */
+	uint64_t first = (sched->time | 1u) + 1u;
+	uint64_t last_tick = cpu->double_speed ? 1u : 0u;
+	if (sched->next <= first + last_tick) {
+		return 0;
+	}
+	uint64_t cycles = (sched->next - first - last_tick - 1u) / 2u + 1u;
+	if (cycles > max_cycles) {
+		cycles = max_cycles;
+	}
+	return (uint32_t)cycles;
+}
+
+/*
+ * Equivalent to calling gbcc_emulate_cycle() the given number of times, as
+ * long as halted_cycles(), idle_loop_cycles() or remaining_cycles() said that
+ * was safe.
+ */
+void fast_forward(struct gbcc_core *gbc, uint32_t cycles)
+{
+	struct cpu *cpu = &gbc->cpu;
+	struct gbcc_scheduler *sched = &gbc->scheduler;
+	uint32_t clocks = cpu->double_speed ? 2 * cycles : cycles;
+
+	sched->time = (sched->time | 1u) + 1u + 2u * (cycles - 1u);
+	if (cpu->double_speed) {
+		sched->time++;
+	}
+	if (cpu->instruction.remaining > 0 && !(cpu->halt.set || cpu->stop)) {
+		cpu->instruction.remaining -= (uint8_t)((cpu->clock + clocks) / 4u);
+	}
+	cpu->clock = (uint8_t)((cpu->clock + clocks) & 3u);
+	cpu->interrupt.request = false;
+}
+
 uint8_t gbcc_fetch_instruction(struct gbcc_core *gbc)
 {
 	struct cpu *cpu = &gbc->cpu;
+	if (cpu->instruction.prefetched > 0) {
+		cpu->reg.pc++;
+		return cpu->instruction.operands[--cpu->instruction.prefetched];
+	}
 	if (cpu->halt.skip) {
 		/* HALT bug; CPU fails to increment pc */
 		cpu->halt.skip = false;
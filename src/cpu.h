@@ -82,9 +82,6 @@ struct cpu {
 	bool ime;
 	bool stop;
 	bool double_speed;
-	bool tac_bit;
-	uint16_t div_timer;
-	uint8_t tima_reload;
 	uint8_t clock;
 	struct {
 		uint8_t timer;
@@ -96,14 +93,16 @@ struct cpu {
 		bool skip;
 	} halt;
 	struct {
-		uint16_t source;
+		uint16_t source;	/* Next byte to be copied */
 		uint16_t new_source;
-		uint16_t timer;
+		uint16_t timer;		/* Bytes left to be counted off */
 		bool requested;
 		bool running;
 	} dma;
 	struct {
 		uint16_t addr;
+		/* IE & IF, updated whenever either is written */
+		uint8_t pending;
 		bool request;
 		bool running;
 	} interrupt;
@@ -112,6 +111,11 @@ struct cpu {
 		uint8_t op1;
 		uint8_t op2;
 		uint8_t step;
+		/* M-cycles left of an instruction that was executed at once */
+		uint8_t remaining;
+		/* Operands already read from the instruction cache */
+		uint8_t operands[2];
+		uint8_t prefetched;
 		bool running;
 		bool prefix_cb;
 	} instruction;
@@ -119,5 +123,6 @@ struct cpu {
 
 uint8_t gbcc_fetch_instruction(struct gbcc_core *gbc);
 void gbcc_emulate_cycle(struct gbcc_core *gbc);
+uint32_t gbcc_emulate_cycles(struct gbcc_core *gbc, uint32_t max_cycles);
 
 #endif /* GBCC_CPU_H */
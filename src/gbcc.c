@@ -19,31 +19,39 @@ void *gbcc_emulation_loop(void *_gbc)
 	gbcc_load(gbc);
 	bool is_camera = gbc->core.cart.mbc.type == CAMERA;
 	while (!gbc->quit) {
-		for (int i = 1000; i > 0; i--) {
+		for (uint32_t i = 1000; i > 0;) {
 			/* Only check for savestates, pause etc.
 			 * every 1000 cycles */
-			gbcc_emulate_cycle(&gbc->core);
+			uint32_t max_cycles = i;
+			if (is_camera) {
+				/* The camera's capture timer is clocked every cycle */
+				max_cycles = 1;
+			} else {
+				uint32_t until_sample = gbcc_audio_cycles_until_sample(gbc);
+				if (until_sample < max_cycles) {
+					max_cycles = until_sample;
+				}
+			}
+			uint32_t cycles = gbcc_emulate_cycles(&gbc->core, max_cycles);
 			if (gbc->core.error) {
 				gbcc_log_error("Invalid opcode: 0x%02X\n", gbc->core.cpu.opcode);
 				gbcc_print_registers(&gbc->core, false);
 				gbc->quit = true;
 				return 0;
 			}
-			gbcc_audio_update(gbc);
+			gbcc_audio_update(gbc, cycles);
 			if (is_camera) {
 				gbcc_camera_clock(gbc);
 			}
+			i -= cycles;
 		}
 		if (gbc->load_state > 0) {
 			gbcc_load_state(gbc);
 		} else if (gbc->save_state > 0) {
 			gbcc_save_state(gbc);
 		}
-		if (gbc->autosave && gbc->core.cart.mbc.sram_changed) {
-			if (time(NULL) > gbc->core.cart.mbc.last_save_time) {
-				gbcc_save(gbc);
-				gbc->core.cart.mbc.sram_changed = false;
-			}
+		if (gbc->autosave) {
+			gbcc_autosave(gbc);
 		}
 		while (gbc->pause || gbc->menu.show || !(gbc->has_focus || gbc->background_play)) {
 			const struct timespec time = {.tv_sec = 0, .tv_nsec = 10000000};
@@ -13,6 +13,7 @@
 #include "../debug.h"
 #include "../input.h"
 #include "../nelem.h"
+#include "../ppu.h"
 #include "../save.h"
 #include "../time_diff.h"
 #include "gtk.h"
@@ -517,7 +518,7 @@ void change_palette(GtkWidget *widget, void *data)
 	struct gbcc_gtk *gtk = (struct gbcc_gtk *)data;
 	struct gbcc *gbc = &gtk->gbc;
 	const gchar *name = gtk_menu_item_get_label(GTK_MENU_ITEM(widget));
-	gbc->core.ppu.palette = gbcc_get_palette(name);
+	gbcc_ppu_set_palette(&gbc->core, gbcc_get_palette(name));
 }
 
 void toggle_vram_display(GtkCheckMenuItem *widget, void *data)
@@ -626,7 +627,6 @@ void stop_emulation_thread(struct gbcc_gtk *gtk)
 		return;
 	}
 	gbc->quit = true;
-	sem_post(&gbc->core.ppu.vsync_semaphore);
 	pthread_join(gtk->emulation_thread, NULL);
 	gbcc_camera_destroy(gbc);
 	gbc->save_state = 0;
@@ -12,7 +12,15 @@
 #include "core.h"
 #include "hdma.h"
 #include "memory.h"
+#include "tile_cache.h"
+#include <string.h>
 
+/*
+ * Copies one M-cycle's worth of bytes. Blocks are 16-byte aligned, so a
+ * chunk never crosses a page, and when both ends are mapped it's copied
+ * straight between them, rather than a byte at a time through the memory
+ * handlers.
+ */
 void gbcc_hdma_copy_chunk(struct gbcc_core *gbc)
 {
 	if (gbc->hdma.to_copy <= 0) {
@@ -20,13 +28,48 @@ void gbcc_hdma_copy_chunk(struct gbcc_core *gbc)
 		return;
 	}
 	/* In single speed mode, hdma copies twice as much per clock */
-	for (int i = 0; i < 4 * (1 + !gbc->cpu.double_speed) && gbc->hdma.to_copy > 0; i++) {
-		gbcc_memory_copy(gbc, gbc->hdma.source, gbc->hdma.dest);
-		gbc->hdma.source++;
-		gbc->hdma.dest++;
-		gbc->hdma.length--;
-		gbc->hdma.to_copy--;
+	uint16_t len = 4u * (1u + !gbc->cpu.double_speed);
+	if (len > gbc->hdma.to_copy) {
+		len = gbc->hdma.to_copy;
+	}
+	uint16_t source = gbc->hdma.source;
+	uint16_t dest = gbc->hdma.dest;
+	const uint8_t *src_page = gbc->memory.read_map[source >> 8u];
+	uint8_t *dest_page = gbc->memory.write_map[dest >> 8u];
+	bool patched = source < ROMX_END && gbc->cheats.enabled;
+	bool direct = src_page != NULL && dest_page != NULL && !patched
+		&& (source & 0xFFu) + len <= 0x100u
+		&& (dest & 0xFFu) + len <= 0x100u;
+	if (direct) {
+		/* As gbcc_memory_write() would, in case VRAM is OAM DMA's source */
+		if (gbc->cpu.dma.timer > 0) {
+			gbcc_memory_dma_sync(gbc);
+		}
+		memcpy(dest_page + (dest & 0xFFu), src_page + (source & 0xFFu), len);
+		/* Chunks are at most half a tile, so never span two tiles */
+		gbcc_tile_cache_write(gbc, dest);
+	} else {
+		for (uint16_t i = 0; i < len; i++) {
+			gbcc_memory_copy(gbc, (uint16_t)(source + i), (uint16_t)(dest + i));
+		}
+	}
+	gbc->hdma.source = (uint16_t)(source + len);
+	gbc->hdma.dest = (uint16_t)(dest + len);
+	gbc->hdma.length -= len;
+	gbc->hdma.to_copy -= len;
+	gbc->hdma.stale = true;
+}
+
+/*
+ * The HDMA registers track the transfer's progress, but are only brought up
+ * to date when they're accessed.
+ */
+void gbcc_hdma_sync(struct gbcc_core *gbc)
+{
+	if (!gbc->hdma.stale) {
+		return;
 	}
+	gbc->hdma.stale = false;
 	gbcc_memory_write_force(gbc, HDMA1, (gbc->hdma.source >> 8u));
 	gbcc_memory_write_force(gbc, HDMA2, (gbc->hdma.source & 0xFFu));
 	gbcc_memory_write_force(gbc, HDMA3, (gbc->hdma.dest >> 8u));
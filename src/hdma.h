@@ -14,5 +14,6 @@
 #include "core.h"
 
 void gbcc_hdma_copy_chunk(struct gbcc_core *gbc);
+void gbcc_hdma_sync(struct gbcc_core *gbc);
 
 #endif /* GBCC_HDMA_H */
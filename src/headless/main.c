@@ -24,8 +24,8 @@ int main(int argc, char **argv)
 	gbc.core.keys.turbo = true;
 	gbc.has_focus = true;
 
-	for (size_t cycles = 10000; cycles > 0; cycles--) {
-		gbcc_emulate_cycle(&gbc.core);
+	for (uint32_t cycles = 10000; cycles > 0;) {
+		cycles -= gbcc_emulate_cycles(&gbc.core, cycles);
 	}
 
 	exit(EXIT_SUCCESS);
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "core.h"
+#include "cheats.h"
+#include "debug.h"
+#include "icache.h"
+#include "memory.h"
+#include "ops.h"
+#include <stdlib.h>
+#include <string.h>
+
+static size_t ram_index(struct gbcc_core *gbc, uint16_t addr);
+static struct gbcc_icache_entry *rom_entry(struct gbcc_core *gbc, uint16_t pc);
+static struct gbcc_icache_entry *ram_entry(struct gbcc_core *gbc, uint16_t pc);
+static void decode(struct gbcc_core *gbc, uint16_t pc, struct gbcc_icache_entry *entry);
+static void flush_page(struct gbcc_icache *cache, size_t page);
+
+void gbcc_icache_init(struct gbcc_core *gbc)
+{
+	struct gbcc_icache *cache = calloc(1, sizeof(*cache));
+	if (!cache) {
+		gbcc_log_error("Failed to allocate instruction cache.\n");
+		return;
+	}
+	cache->rom_banks = gbc->cart.rom_size / ROMX_SIZE;
+	cache->rom = calloc(cache->rom_banks, sizeof(*cache->rom));
+	if (!cache->rom) {
+		cache->rom_banks = 0;
+	}
+	gbc->icache = cache;
+}
+
+void gbcc_icache_free(struct gbcc_core *gbc)
+{
+	struct gbcc_icache *cache = gbc->icache;
+	if (!cache) {
+		return;
+	}
+	for (size_t i = 0; i < cache->rom_banks; i++) {
+		free(cache->rom[i]);
+	}
+	free(cache->rom);
+	free(cache);
+	gbc->icache = NULL;
+}
+
+/*
+ * Returns the decoded instruction at pc, decoding it first if needed, or NULL
+ * if it can't be cached (e.g. it's not in ROM or RAM, or straddles a bank).
+ */
+const struct gbcc_icache_entry *gbcc_icache_lookup(struct gbcc_core *gbc, uint16_t pc)
+{
+	struct gbcc_icache_entry *entry;
+	if (!gbc->icache) {
+		return NULL;
+	}
+	if (pc < ROMX_END) {
+		entry = rom_entry(gbc, pc);
+	} else {
+		entry = ram_entry(gbc, pc);
+	}
+	if (!entry) {
+		return NULL;
+	}
+	if (entry->length == 0) {
+		decode(gbc, pc, entry);
+	}
+	return entry;
+}
+
+/* Called on every write to WRAM or HRAM, to drop any code that was there */
+void gbcc_icache_ram_write(struct gbcc_core *gbc, uint16_t addr)
+{
+	struct gbcc_icache *cache = gbc->icache;
+	if (!cache) {
+		return;
+	}
+	size_t page = ram_index(gbc, addr) / GBCC_ICACHE_PAGE_SIZE;
+	if (cache->ram_code[page]) {
+		flush_page(cache, page);
+	}
+}
+
+void gbcc_icache_flush_ram(struct gbcc_core *gbc)
+{
+	struct gbcc_icache *cache = gbc->icache;
+	if (!cache) {
+		return;
+	}
+	memset(cache->ram, 0, sizeof(cache->ram));
+	memset(cache->ram_code, 0, sizeof(cache->ram_code));
+}
+
+/* Physical index of a WRAM or HRAM address, taking WRAM banking into account */
+size_t ram_index(struct gbcc_core *gbc, uint16_t addr)
+{
+	if (addr < WRAMX_START) {
+		return addr - WRAM0_START;
+	}
+	if (addr < WRAMX_END) {
+		size_t bank_offset = (size_t)(gbc->memory.wramx - gbc->memory.wram_bank[0]);
+		return bank_offset + (addr - WRAMX_START);
+	}
+	return sizeof(gbc->memory.wram_bank) + (addr - HRAM_START);
+}
+
+struct gbcc_icache_entry *rom_entry(struct gbcc_core *gbc, uint16_t pc)
+{
+	struct gbcc_icache *cache = gbc->icache;
+	/* MBC6 doesn't map the ROM directly */
+	if (gbc->cart.mbc.type == MBC6) {
+		return NULL;
+	}
+	/* Don't cache instructions which might cross into the next bank */
+	uint16_t offset = pc % ROMX_SIZE;
+	if (offset > ROMX_SIZE - 3) {
+		return NULL;
+	}
+	/* Nor ones that a Game Genie code might change */
+	if (gbc->cheats.enabled && gbcc_cheats_gamegenie_patched(gbc, pc, 3)) {
+		return NULL;
+	}
+	const uint8_t *base = (pc < ROMX_START) ? gbc->memory.rom0 : gbc->memory.romx;
+	size_t bank = (size_t)(base - gbc->cart.rom) / ROMX_SIZE;
+	if (bank >= cache->rom_banks) {
+		return NULL;
+	}
+	if (!cache->rom[bank]) {
+		cache->rom[bank] = calloc(ROMX_SIZE, sizeof(*cache->rom[bank]));
+		if (!cache->rom[bank]) {
+			return NULL;
+		}
+	}
+	return &cache->rom[bank][offset];
+}
+
+struct gbcc_icache_entry *ram_entry(struct gbcc_core *gbc, uint16_t pc)
+{
+	struct gbcc_icache *cache = gbc->icache;
+	if (pc >= WRAM0_START && pc < WRAMX_END) {
+		/* Don't cache instructions which might cross into the next bank */
+		if (pc % WRAMX_SIZE > WRAMX_SIZE - 3) {
+			return NULL;
+		}
+	} else if (pc < HRAM_START || pc > HRAM_END - 3) {
+		return NULL;
+	}
+	size_t index = ram_index(gbc, pc);
+	cache->ram_code[index / GBCC_ICACHE_PAGE_SIZE] = true;
+	cache->ram_code[(index + 2) / GBCC_ICACHE_PAGE_SIZE] = true;
+	return &cache->ram[index];
+}
+
+void decode(struct gbcc_core *gbc, uint16_t pc, struct gbcc_icache_entry *entry)
+{
+	entry->opcode = gbcc_memory_read(gbc, pc);
+	entry->length = gbcc_op_lengths[entry->opcode];
+	entry->operands[0] = 0;
+	entry->operands[1] = 0;
+	for (uint8_t i = 1; i < entry->length; i++) {
+		entry->operands[i - 1] = gbcc_memory_read(gbc, (uint16_t)(pc + i));
+	}
+}
+
+/*
+ * Instructions are up to 3 bytes long, so any starting in the last two bytes
+ * of the previous page may also have been written to.
+ */
+void flush_page(struct gbcc_icache *cache, size_t page)
+{
+	size_t start = page * GBCC_ICACHE_PAGE_SIZE;
+	size_t end = start + GBCC_ICACHE_PAGE_SIZE;
+	if (start >= 2) {
+		start -= 2;
+	}
+	if (end > GBCC_ICACHE_RAM_SIZE) {
+		end = GBCC_ICACHE_RAM_SIZE;
+	}
+	for (size_t i = start; i < end; i++) {
+		cache->ram[i].length = 0;
+	}
+	cache->ram_code[page] = false;
+}
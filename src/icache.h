@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef GBCC_ICACHE_H
+#define GBCC_ICACHE_H
+
+#include "constants.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Cache of decoded instructions, so that hot code doesn't have to be read
+ * back through the memory map every time it's executed.
+ *
+ * ROM never changes, so entries are indexed by their offset into the ROM and
+ * stay valid forever. WRAM & HRAM entries are indexed by physical address,
+ * and are thrown away a page at a time when that page is written to.
+ */
+
+#define GBCC_ICACHE_PAGE_SIZE 0x100u
+#define GBCC_ICACHE_RAM_SIZE (8 * WRAMX_SIZE + HRAM_SIZE)
+#define GBCC_ICACHE_RAM_PAGES ((GBCC_ICACHE_RAM_SIZE + GBCC_ICACHE_PAGE_SIZE - 1) / GBCC_ICACHE_PAGE_SIZE)
+
+struct gbcc_core;
+
+struct gbcc_icache_entry {
+	uint8_t opcode;
+	uint8_t operands[2];
+	uint8_t length;		/* 0 if not yet decoded */
+};
+
+struct gbcc_icache {
+	/* One array per ROM bank, allocated on first use */
+	struct gbcc_icache_entry **rom;
+	size_t rom_banks;
+	struct gbcc_icache_entry ram[GBCC_ICACHE_RAM_SIZE];
+	/* Whether each page of RAM has any decoded instructions in it */
+	bool ram_code[GBCC_ICACHE_RAM_PAGES];
+};
+
+void gbcc_icache_init(struct gbcc_core *gbc);
+void gbcc_icache_free(struct gbcc_core *gbc);
+const struct gbcc_icache_entry *gbcc_icache_lookup(struct gbcc_core *gbc, uint16_t pc);
+void gbcc_icache_ram_write(struct gbcc_core *gbc, uint16_t addr);
+void gbcc_icache_flush_ram(struct gbcc_core *gbc);
+
+#endif /* GBCC_ICACHE_H */
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "core.h"
+#include "bit_utils.h"
+#include "constants.h"
+#include "debug.h"
+#include "icache.h"
+#include "idle.h"
+#include "memory.h"
+#include "ops.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+/* Longest loop that will be recognised, in instructions & bytes */
+#define MAX_LOOP_INSTRUCTIONS 8
+#define MAX_LOOP_BYTES 0x20u
+
+/* Most ROMs which can have idle-skip disabled by title */
+#define MAX_EXCLUDED_TITLES 32
+
+static struct {
+	bool disabled;
+	uint8_t num_excluded;
+	char excluded[MAX_EXCLUDED_TITLES][CART_TITLE_SIZE + 1];
+} settings;
+
+static uint16_t rom_bank(struct gbcc_core *gbc, uint16_t pc);
+static uint8_t analyse(struct gbcc_core *gbc, uint16_t start);
+static bool is_stable(uint16_t addr);
+static void snapshot(struct gbcc_core *gbc);
+static bool registers_unchanged(struct gbcc_core *gbc);
+
+void gbcc_idle_skip_enable(bool enable)
+{
+	settings.disabled = !enable;
+}
+
+void gbcc_idle_skip_exclude(const char *title)
+{
+	if (settings.num_excluded >= MAX_EXCLUDED_TITLES) {
+		gbcc_log_error("Too many idle-skip exclusions, ignoring %s.\n", title);
+		return;
+	}
+	char *excluded = settings.excluded[settings.num_excluded++];
+	strncpy(excluded, title, CART_TITLE_SIZE);
+	excluded[CART_TITLE_SIZE] = '\0';
+}
+
+void gbcc_idle_skip_apply(struct gbcc_core *gbc)
+{
+	gbc->idle_skip = !settings.disabled;
+	for (uint8_t i = 0; i < settings.num_excluded; i++) {
+		if (strcasecmp(settings.excluded[i], gbc->cart.title) == 0) {
+			gbc->idle_skip = false;
+		}
+	}
+}
+
+/*
+ * Called at an instruction boundary, just before the next opcode is fetched.
+ * Returns the length in M-cycles of the loop starting at pc, if the CPU has
+ * just been once round it without changing anything, or 0 otherwise.
+ *
+ * Loops must be in ROM, consist only of instructions which don't write
+ * anything other than registers, and end with a jump back to the start. They
+ * can only read memory which doesn't change between events, so that as long
+ * as no event happened during this iteration, the next one will do exactly
+ * the same thing. Any interrupt (or HDMA) in the middle of an iteration shows
+ * up as it taking too long.
+ */
+uint8_t gbcc_idle_loop_check(struct gbcc_core *gbc)
+{
+	struct gbcc_idle_loop *idle = &gbc->idle;
+	uint16_t pc = gbc->cpu.reg.pc;
+	uint16_t last_pc = idle->last_pc;
+	idle->last_pc = pc;
+
+	/* Only interested in the targets of short backwards jumps */
+	if (pc > last_pc || (uint16_t)(last_pc - pc) > MAX_LOOP_BYTES || pc >= ROMX_END) {
+		return 0;
+	}
+	/* MBC6 maps ROM in half-banks, which the cache doesn't handle */
+	if (gbc->cart.mbc.type == MBC6) {
+		return 0;
+	}
+	uint16_t bank = rom_bank(gbc, pc);
+	if (pc != idle->pc || bank != idle->bank) {
+		idle->pc = pc;
+		idle->bank = bank;
+		idle->period = analyse(gbc, pc);
+		snapshot(gbc);
+		return 0;
+	}
+	if (idle->period == 0) {
+		return 0;
+	}
+	uint64_t now = gbc->scheduler.time;
+	uint64_t ticks_per_cycle = gbc->cpu.double_speed ? 4u : 8u;
+	bool repeated = (now - idle->time == idle->period * ticks_per_cycle)
+		&& idle->next_event > now
+		&& idle->ifreg == gbcc_memory_read_force(gbc, IF)
+		&& registers_unchanged(gbc);
+	snapshot(gbc);
+	return repeated ? idle->period : 0;
+}
+
+uint16_t rom_bank(struct gbcc_core *gbc, uint16_t pc)
+{
+	const uint8_t *base = (pc < ROMX_START) ? gbc->memory.rom0 : gbc->memory.romx;
+	return (uint16_t)((size_t)(base - gbc->cart.rom) / ROMX_SIZE);
+}
+
+/*
+ * Returns the number of M-cycles taken by one iteration of the loop starting
+ * at start, or 0 if it isn't a loop that can be skipped.
+ */
+uint8_t analyse(struct gbcc_core *gbc, uint16_t start)
+{
+	uint16_t pc = start;
+	uint8_t cycles = 0;
+	for (int i = 0; i < MAX_LOOP_INSTRUCTIONS; i++) {
+		if ((pc < ROMX_START) != (start < ROMX_START) || pc >= ROMX_END) {
+			return 0;
+		}
+		const struct gbcc_icache_entry *entry = gbcc_icache_lookup(gbc, pc);
+		if (!entry) {
+			return 0;
+		}
+		uint8_t opcode = entry->opcode;
+		uint8_t time = gbcc_op_times[opcode];
+		uint16_t next = (uint16_t)(pc + entry->length);
+		switch (opcode) {
+			case 0x18u:	/* JR */
+			case 0x20u:	/* JR cc */
+			case 0x28u:
+			case 0x30u:
+			case 0x38u:
+				next = (uint16_t)(next + (int8_t)entry->operands[0]);
+				return (next == start) ? cycles + time : 0;
+			case 0xC2u:	/* JP cc */
+			case 0xC3u:	/* JP */
+			case 0xCAu:
+			case 0xD2u:
+			case 0xDAu:
+				next = cat_bytes(entry->operands[0], entry->operands[1]);
+				return (next == start) ? cycles + time : 0;
+			case 0xCBu:
+				/* Everything apart from (hl) only touches registers */
+				if (entry->operands[0] % 0x08u == 6) {
+					return 0;
+				}
+				time = 2;
+				break;
+			case 0xF0u:	/* LDH A, (a8) */
+				if (!is_stable(cat_bytes(entry->operands[0], 0xFFu))) {
+					return 0;
+				}
+				break;
+			case 0xFAu:	/* LD A, (a16) */
+				if (!is_stable(cat_bytes(entry->operands[0], entry->operands[1]))) {
+					return 0;
+				}
+				break;
+			default:
+				if (gbcc_op_access[opcode] != GBCC_ACCESS_NONE
+						|| gbcc_op_ends_block[opcode]) {
+					return 0;
+				}
+				break;
+		}
+		cycles += time;
+		pc = next;
+	}
+	return 0;
+}
+
+/* Whether reading from addr gives the same value until the next event */
+bool is_stable(uint16_t addr)
+{
+	if (addr >= WRAM0_START && addr < WRAMX_END) {
+		return true;
+	}
+	if (addr >= HRAM_START) {
+		/* Includes IE */
+		return true;
+	}
+	if (addr < IOREG_START || addr >= IOREG_END) {
+		return false;
+	}
+	/* DIV & TIMA count continuously, and the APU is clocked lazily */
+	if (addr == DIV || addr == TIMA) {
+		return false;
+	}
+	return addr < NR10 || addr >= WAVE_END;
+}
+
+void snapshot(struct gbcc_core *gbc)
+{
+	struct gbcc_idle_loop *idle = &gbc->idle;
+	idle->time = gbc->scheduler.time;
+	idle->next_event = gbc->scheduler.next;
+	/* IF can also be changed by the timer or joypad */
+	idle->ifreg = gbcc_memory_read_force(gbc, IF);
+	idle->af = gbc->cpu.reg.af;
+	idle->bc = gbc->cpu.reg.bc;
+	idle->de = gbc->cpu.reg.de;
+	idle->hl = gbc->cpu.reg.hl;
+	idle->sp = gbc->cpu.reg.sp;
+}
+
+bool registers_unchanged(struct gbcc_core *gbc)
+{
+	struct gbcc_idle_loop *idle = &gbc->idle;
+	return idle->af == gbc->cpu.reg.af
+		&& idle->bc == gbc->cpu.reg.bc
+		&& idle->de == gbc->cpu.reg.de
+		&& idle->hl == gbc->cpu.reg.hl
+		&& idle->sp == gbc->cpu.reg.sp;
+}
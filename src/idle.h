@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef GBCC_IDLE_H
+#define GBCC_IDLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Detection of idle loops, where the CPU spins on something like
+ *
+ * 	.wait:	ldh a, [rLY]
+ * 		cp 144
+ * 		jr nz, .wait
+ *
+ * rather than halting. Once a loop has been seen to come back round to
+ * where it started without changing anything, it will keep doing so until
+ * one of the values it reads changes, which can only happen on a scheduled
+ * event or interrupt, so whole iterations can be skipped until then.
+ */
+
+struct gbcc_core;
+
+struct gbcc_idle_loop {
+	/* Start of the most recently analysed loop */
+	uint16_t pc;
+	uint16_t bank;
+	/* M-cycles per iteration, or 0 if it isn't an idle loop */
+	uint8_t period;
+	/* pc at the previous instruction boundary */
+	uint16_t last_pc;
+	/* State the last time the loop started an iteration */
+	uint64_t time;
+	uint64_t next_event;
+	uint8_t ifreg;
+	uint16_t af;
+	uint16_t bc;
+	uint16_t de;
+	uint16_t hl;
+	uint16_t sp;
+	/* Total number of cycles skipped */
+	uint64_t skipped;
+};
+
+uint8_t gbcc_idle_loop_check(struct gbcc_core *gbc);
+
+/*
+ * The idle-skip settings are read from the config file, which may happen
+ * before any ROM is loaded, so they're kept here rather than in the core,
+ * and applied by gbcc_initialise() once the cartridge title is known.
+ */
+void gbcc_idle_skip_enable(bool enable);
+void gbcc_idle_skip_exclude(const char *title);
+void gbcc_idle_skip_apply(struct gbcc_core *gbc);
+
+#endif /* GBCC_IDLE_H */
@@ -13,17 +13,26 @@
 #include "bit_utils.h"
 #include "constants.h"
 #include "debug.h"
+#include "icache.h"
+#include "idle.h"
 #include "memory.h"
 #include "nelem.h"
 #include "palettes.h"
+#include "ppu.h"
 #include "save.h"
+#include "scheduler.h"
+#include "tile_cache.h"
+#include "timer.h"
+#include "triple_buffer.h"
 #include <errno.h>
-#include <semaphore.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 static const uint8_t nintendo_logo[CART_LOGO_SIZE] = {
 	0xCEu, 0xEDu, 0x66u, 0x66u, 0xCCu, 0x0Du, 0x00u, 0x0Bu,
@@ -35,6 +44,9 @@ static const uint8_t nintendo_logo[CART_LOGO_SIZE] = {
 };
 
 static void load_rom(struct gbcc_core *gbc, const char *filename);
+static const uint8_t *map_rom(FILE *file, size_t size);
+static void unmap_rom(struct gbcc_core *gbc);
+static size_t rom_map_size(size_t size);
 static void parse_header(struct gbcc_core *gbc);
 static bool verify_cartridge(struct gbcc_core *gbc, bool print);
 static void load_title(struct gbcc_core *gbc);
@@ -53,6 +65,7 @@ void gbcc_initialise(struct gbcc_core *gbc, const char *filename)
 	gbc->error_msg = NULL;
 	gbc->version = GBCC_SAVE_STATE_VERSION;
 	gbc->cart.filename = filename;
+	gbcc_scheduler_init(gbc);
 	gbc->cart.mbc.type = NONE;
 	gbc->cart.mbc.romx_bank = 0x01u;
 	gbc->cart.mbc.sram_bank = 0x00u;
@@ -62,10 +75,11 @@ void gbcc_initialise(struct gbcc_core *gbc, const char *filename)
 	gbc->cpu.ime = false;
 	gbc->ppu.clock = 0;
 	gbc->ppu.palette = gbcc_get_palette("default");
-	gbc->ppu.screen.buffer_0 = calloc(GBC_SCREEN_SIZE, sizeof(uint32_t));
-	gbc->ppu.screen.buffer_1 = calloc(GBC_SCREEN_SIZE, sizeof(uint32_t));
-	gbc->ppu.screen.gbc = gbc->ppu.screen.buffer_0;
-	gbc->ppu.screen.sdl = gbc->ppu.screen.buffer_1;
+	gbc->ppu.sprite_lines.dirty = true;
+	gbcc_triple_buffer_init(gbc);
+	if (gbc->error) {
+		return;
+	}
 	load_rom(gbc, filename);
 	if (gbc->error) {
 		return;
@@ -74,9 +88,13 @@ void gbcc_initialise(struct gbcc_core *gbc, const char *filename)
 	if (gbc->error) {
 		return;
 	}
+	gbcc_idle_skip_apply(gbc);
 	init_mmap(gbc);
 	init_ioreg(gbc);
+	gbcc_ppu_update_colours(gbc);
 	gbcc_apu_init(gbc);
+	gbcc_ppu_reschedule(gbc);
+	gbcc_timer_reschedule(gbc);
 
 	for (size_t i = 0; i < N_ELEM(gbc->memory.wram_bank); i++) {
 		for (size_t j = 0; j < N_ELEM(gbc->memory.wram_bank[i]); j++) {
@@ -87,7 +105,8 @@ void gbcc_initialise(struct gbcc_core *gbc, const char *filename)
 		gbc->memory.hram[i] = (uint8_t)rand();
 	}
 
-	sem_init(&gbc->ppu.vsync_semaphore, 0, 0);
+	gbcc_icache_init(gbc);
+	gbcc_tile_cache_init(gbc);
 	gbc->initialised = true;
 }
 
@@ -97,13 +116,13 @@ void gbcc_free(struct gbcc_core *gbc)
 		return;
 	}
 	gbc->initialised = false;
-	sem_destroy(&gbc->ppu.vsync_semaphore);
-	free(gbc->cart.rom);
+	unmap_rom(gbc);
 	if (gbc->cart.ram_size > 0) {
 		free(gbc->cart.ram);
 	}
-	free(gbc->ppu.screen.buffer_0);
-	free(gbc->ppu.screen.buffer_1);
+	gbcc_triple_buffer_free(gbc);
+	gbcc_icache_free(gbc);
+	gbcc_tile_cache_free(gbc);
 	*gbc = (const struct gbcc_core){0};
 }
 
@@ -144,39 +163,78 @@ void load_rom(struct gbcc_core *gbc, const char *filename)
 
 	if (gbc->cart.rom_banks < 2) {
 		gbcc_log_warning("ROM smaller than minimum size of 2 banks\n");
-		gbc->cart.rom = (uint8_t *) calloc(ROMX_END, 1);
 		gbc->cart.rom_banks = 2;
-	} else {
-		gbc->cart.rom = (uint8_t *) calloc(gbc->cart.rom_size, 1);
 	}
+
+	gbc->cart.rom = map_rom(rom, gbc->cart.rom_size);
 	if (gbc->cart.rom == NULL) {
-		gbcc_log_error("Error allocating ROM.\n");
+		gbcc_log_error("Error reading from file %s: %s\n", filename, strerror(errno));
 		fclose(rom);
 		gbc->error = true;
 		gbc->error_msg = "Couldn't read ROM file.\n";
 		return;
 	}
 
+	fclose(rom);
+	gbcc_log_info("\tROM loaded.\n");
+}
 
-	if (fseek(rom, 0, SEEK_SET) != 0) {
-		gbcc_log_error("Error seeking in file %s: %s\n", filename, strerror(errno));
-		fclose(rom);
-		gbc->error = true;
-		gbc->error_msg = "Couldn't read ROM file.\n";
-		return;
+/*
+ * The ROM is never written to, so where possible it's mapped straight from
+ * the file, letting every instance running the same ROM share the same
+ * pages. ROMs smaller than the minimum of 2 banks are mapped over the start
+ * of a zeroed block, rather than being copied into one.
+ */
+const uint8_t *map_rom(FILE *file, size_t size)
+{
+	size_t map_size = rom_map_size(size);
+#ifdef _WIN32
+	uint8_t *rom = calloc(map_size, 1);
+	if (rom == NULL) {
+		return NULL;
+	}
+	if (fseek(file, 0, SEEK_SET) != 0 || fread(rom, 1, size, file) == 0) {
+		free(rom);
+		return NULL;
+	}
+	return rom;
+#else
+	void *rom;
+	if (map_size > size) {
+		void *zero = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (zero == MAP_FAILED) {
+			return NULL;
+		}
+		rom = mmap(zero, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fileno(file), 0);
+		if (rom == MAP_FAILED) {
+			munmap(zero, map_size);
+			return NULL;
+		}
+	} else {
+		rom = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+		if (rom == MAP_FAILED) {
+			return NULL;
+		}
 	}
+	return rom;
+#endif
+}
 
-	size_t read = fread(gbc->cart.rom, 1, gbc->cart.rom_size, rom);
-	if (read == 0) {
-		gbcc_log_error("Error reading from file %s: %s\n", filename, strerror(errno));
-		fclose(rom);
-		gbc->error = true;
-		gbc->error_msg = "Couldn't read ROM file.\n";
+void unmap_rom(struct gbcc_core *gbc)
+{
+	if (gbc->cart.rom == NULL) {
 		return;
 	}
+#ifdef _WIN32
+	free((uint8_t *)gbc->cart.rom);
+#else
+	munmap((void *)gbc->cart.rom, rom_map_size(gbc->cart.rom_size));
+#endif
+}
 
-	fclose(rom);
-	gbcc_log_info("\tROM loaded.\n");
+size_t rom_map_size(size_t size)
+{
+	return (size < ROMX_END) ? ROMX_END : size;
 }
 
 void parse_header(struct gbcc_core *gbc)
@@ -258,7 +316,7 @@ bool verify_cartridge(struct gbcc_core *gbc, bool print)
 
 void load_title(struct gbcc_core *gbc)
 {
-	uint8_t *title = gbc->memory.rom0 + CART_TITLE_START;
+	const uint8_t *title = gbc->memory.rom0 + CART_TITLE_START;
 	memcpy(gbc->cart.title, title, CART_TITLE_SIZE);
 	gbc->cart.title[CART_TITLE_SIZE] = '\0';
 	gbcc_log_info("\tTitle: %s\n", gbc->cart.title);
@@ -444,6 +502,7 @@ void get_cartridge_hardware(struct gbcc_core *gbc)
 			gbc->cart.mbc.type = MBC3;
 			break;
 	}
+	gbcc_mbc_bind(gbc);
 }
 
 void init_ram(struct gbcc_core *gbc)
@@ -545,6 +604,7 @@ void init_mmap(struct gbcc_core *gbc)
 	gbc->memory.wram0 = gbc->memory.wram_bank[0];
 	gbc->memory.wramx = gbc->memory.wram_bank[1];
 	gbc->memory.echo = gbc->memory.wram0;
+	gbcc_memory_remap(gbc);
 }
 
 void init_ioreg(struct gbcc_core *gbc)
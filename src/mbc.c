@@ -12,6 +12,7 @@
 #include "bit_utils.h"
 #include "debug.h"
 #include "mbc.h"
+#include "memory.h"
 #include "time_diff.h"
 #include <stdio.h>
 #include <string.h>
@@ -21,6 +22,30 @@ static void set_mbc_banks(struct gbcc_core *gbc);
 static void eeprom_write(struct gbcc_core *gbc, uint8_t val);
 static void eeprom_reset(struct gbcc_eeprom *eeprom);
 
+static const struct gbcc_mbc_ops mbc_ops[] = {
+	[NONE] = {gbcc_mbc_none_read, gbcc_mbc_none_write},
+	[MBC1] = {gbcc_mbc_mbc1_read, gbcc_mbc_mbc1_write},
+	[MBC2] = {gbcc_mbc_mbc2_read, gbcc_mbc_mbc2_write},
+	[MBC3] = {gbcc_mbc_mbc3_read, gbcc_mbc_mbc3_write},
+	[MBC5] = {gbcc_mbc_mbc5_read, gbcc_mbc_mbc5_write},
+	[MBC6] = {gbcc_mbc_mbc6_read, gbcc_mbc_mbc6_write},
+	[MBC7] = {gbcc_mbc_mbc7_read, gbcc_mbc_mbc7_write},
+	[HUC1] = {gbcc_mbc_huc1_read, gbcc_mbc_huc1_write},
+	[HUC3] = {gbcc_mbc_huc3_read, gbcc_mbc_huc3_write},
+	[MMM01] = {gbcc_mbc_mmm01_read, gbcc_mbc_mmm01_write},
+	[CAMERA] = {gbcc_mbc_cam_read, gbcc_mbc_cam_write}
+};
+
+/*
+ * Point the cartridge at the handlers for its MBC, once its type is known.
+ * This has to be redone after loading a save state, as the pointer won't
+ * be valid any more.
+ */
+void gbcc_mbc_bind(struct gbcc_core *gbc)
+{
+	gbc->cart.mbc.ops = &mbc_ops[gbc->cart.mbc.type];
+}
+
 void set_mbc_banks(struct gbcc_core *gbc)
 {
 	struct gbcc_mbc *mbc = &gbc->cart.mbc;
@@ -47,6 +72,7 @@ void set_mbc_banks(struct gbcc_core *gbc)
 	if (gbc->cart.ram != NULL) {
 		gbc->memory.sram = gbc->cart.ram + mbc->sram_bank * SRAM_SIZE;
 	}
+	gbcc_memory_map_rom(gbc);
 }
 
 uint8_t gbcc_mbc_none_read(struct gbcc_core *gbc, uint16_t addr)
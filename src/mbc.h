@@ -16,10 +16,21 @@
 #include <stdint.h>
 #include <time.h>
 
+/* Cartridge RAM is tracked for saving in pages of this size */
+#define GBCC_SRAM_PAGE_SIZE 0x100u
+#define GBCC_SRAM_MAX_PAGES (0x20000u / GBCC_SRAM_PAGE_SIZE)
+
 struct gbcc_core;
 
+/* Cartridge access handlers for one type of MBC */
+struct gbcc_mbc_ops {
+	uint8_t (*read)(struct gbcc_core *gbc, uint16_t addr);
+	void (*write)(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+};
+
 struct gbcc_mbc {
 	enum MBC type;
+	const struct gbcc_mbc_ops *ops;
 	uint16_t rom0_bank;
 	uint16_t romx_bank;
 	uint8_t sram_bank;
@@ -29,8 +40,12 @@ struct gbcc_mbc {
 	uint8_t ramb;
 	bool unlocked;
 	bool sram_enable;
+	/* Whether anything has been written to the SRAM area since the last save */
 	bool sram_changed;
-	time_t last_save_time;
+	/* Scheduler time of the last save */
+	uint64_t last_save_time;
+	/* One bit per page of cart.ram written to since the last save */
+	uint8_t sram_dirty[GBCC_SRAM_MAX_PAGES / 8];
 	struct gbcc_rtc {
 		struct timespec base_time;
 		uint8_t seconds;
@@ -106,6 +121,8 @@ struct gbcc_mbc {
 	} camera;
 };
 
+void gbcc_mbc_bind(struct gbcc_core *gbc);
+
 uint8_t gbcc_mbc_none_read(struct gbcc_core *gbc, uint16_t addr);
 uint8_t gbcc_mbc_mbc1_read(struct gbcc_core *gbc, uint16_t addr);
 uint8_t gbcc_mbc_mbc2_read(struct gbcc_core *gbc, uint16_t addr);
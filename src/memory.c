@@ -14,11 +14,17 @@
 #include "debug.h"
 #include "gbcc.h"
 #include "hdma.h"
+#include "icache.h"
 #include "mbc.h"
 #include "memory.h"
+#include "nelem.h"
 #include "ppu.h"
 #include "printer.h"
+#include "scheduler.h"
+#include "tile_cache.h"
+#include "timer.h"
 #include <stdio.h>
+#include <string.h>
 
 static const uint8_t ioreg_read_masks[0x80] = {
 /* 0xFF00 */	0x3F, 0xFF, 0x83, 0x00, 0xFF, 0xFF, 0xFF, 0x07,
@@ -94,10 +100,123 @@ static void unused_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
 
 static uint8_t ioreg_read(struct gbcc_core *gbc, uint16_t addr);
 static void ioreg_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static uint8_t read_mask(struct gbcc_core *gbc, uint16_t addr);
+static uint8_t write_value(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+
+static uint8_t joyp_read(struct gbcc_core *gbc, uint16_t addr);
+static void joyp_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void sc_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void timer_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void if_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void apu_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static uint8_t nr52_read(struct gbcc_core *gbc, uint16_t addr);
+static uint8_t wave_read(struct gbcc_core *gbc, uint16_t addr);
+static void wave_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void lcdc_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void stat_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static uint8_t ly_read(struct gbcc_core *gbc, uint16_t addr);
+static void ly_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void lyc_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void dma_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void palette_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void vbk_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static uint8_t hdma_read(struct gbcc_core *gbc, uint16_t addr);
+static void hdma_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void hdma5_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void rp_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static uint8_t bgpd_read(struct gbcc_core *gbc, uint16_t addr);
+static void bgpd_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static uint8_t obpd_read(struct gbcc_core *gbc, uint16_t addr);
+static void obpd_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+static void svbk_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
 
 static uint8_t hram_read(struct gbcc_core *gbc, uint16_t addr);
 static void hram_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
 
+static void update_interrupts(struct gbcc_core *gbc);
+static void sram_mark_dirty(struct gbcc_core *gbc, uint16_t addr);
+
+static void map_pages(struct gbcc_core *gbc, uint16_t start, uint16_t size, const uint8_t *read, uint8_t *write);
+static void map_wram(struct gbcc_core *gbc);
+
+#define IOREG(addr) ((addr) - IOREG_START)
+
+/*
+ * Registers with side effects on reading or writing. Anything without a
+ * handler here is read from & written to the ioreg array directly, according
+ * to the masks above.
+ */
+struct ioreg_handler {
+	uint8_t (*read)(struct gbcc_core *gbc, uint16_t addr);
+	void (*write)(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+};
+
+static const struct ioreg_handler ioreg_handlers[0x80] = {
+	[IOREG(JOYP)] = {joyp_read, joyp_write},
+	[IOREG(SC)] = {NULL, sc_write},
+	[IOREG(DIV)] = {gbcc_timer_read, timer_write},
+	[IOREG(TIMA)] = {gbcc_timer_read, timer_write},
+	[IOREG(TAC)] = {NULL, timer_write},
+	[IOREG(IF)] = {NULL, if_write},
+	[IOREG(NR10)] = {NULL, apu_write},
+	[IOREG(NR11)] = {NULL, apu_write},
+	[IOREG(NR12)] = {NULL, apu_write},
+	[IOREG(NR13)] = {NULL, apu_write},
+	[IOREG(NR14)] = {NULL, apu_write},
+	[IOREG(NR20)] = {NULL, apu_write},
+	[IOREG(NR21)] = {NULL, apu_write},
+	[IOREG(NR22)] = {NULL, apu_write},
+	[IOREG(NR23)] = {NULL, apu_write},
+	[IOREG(NR24)] = {NULL, apu_write},
+	[IOREG(NR30)] = {NULL, apu_write},
+	[IOREG(NR31)] = {NULL, apu_write},
+	[IOREG(NR32)] = {NULL, apu_write},
+	[IOREG(NR33)] = {NULL, apu_write},
+	[IOREG(NR34)] = {NULL, apu_write},
+	[IOREG(NR40)] = {NULL, apu_write},
+	[IOREG(NR41)] = {NULL, apu_write},
+	[IOREG(NR42)] = {NULL, apu_write},
+	[IOREG(NR43)] = {NULL, apu_write},
+	[IOREG(NR44)] = {NULL, apu_write},
+	[IOREG(NR50)] = {NULL, apu_write},
+	[IOREG(NR51)] = {NULL, apu_write},
+	[IOREG(NR52)] = {nr52_read, apu_write},
+	[IOREG(WAVE_START + 0x0u)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0x1u)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0x2u)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0x3u)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0x4u)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0x5u)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0x6u)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0x7u)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0x8u)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0x9u)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0xAu)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0xBu)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0xCu)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0xDu)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0xEu)] = {wave_read, wave_write},
+	[IOREG(WAVE_START + 0xFu)] = {wave_read, wave_write},
+	[IOREG(LCDC)] = {NULL, lcdc_write},
+	[IOREG(STAT)] = {NULL, stat_write},
+	[IOREG(LY)] = {ly_read, ly_write},
+	[IOREG(LYC)] = {NULL, lyc_write},
+	[IOREG(DMA)] = {NULL, dma_write},
+	[IOREG(BGP)] = {NULL, palette_write},
+	[IOREG(OBP0)] = {NULL, palette_write},
+	[IOREG(OBP1)] = {NULL, palette_write},
+	[IOREG(VBK)] = {NULL, vbk_write},
+	[IOREG(HDMA1)] = {hdma_read, hdma_write},
+	[IOREG(HDMA2)] = {hdma_read, hdma_write},
+	[IOREG(HDMA3)] = {hdma_read, hdma_write},
+	[IOREG(HDMA4)] = {hdma_read, hdma_write},
+	[IOREG(HDMA5)] = {hdma_read, hdma5_write},
+	[IOREG(RP)] = {NULL, rp_write},
+	[IOREG(BGPD)] = {bgpd_read, bgpd_write},
+	[IOREG(OBPD)] = {obpd_read, obpd_write},
+	[IOREG(SVBK)] = {NULL, svbk_write}
+};
+
 void gbcc_memory_increment(struct gbcc_core *gbc, uint16_t addr)
 {
 	gbcc_memory_write(gbc, addr, gbcc_memory_read(gbc, addr) + 1);
@@ -121,6 +240,9 @@ void gbcc_memory_clear_bit(struct gbcc_core *gbc, uint16_t addr, uint8_t b)
 ANDROID_INLINE
 uint8_t gbcc_memory_read_force(struct gbcc_core *gbc, uint16_t addr) {
 	if (addr >= OAM_START && addr < OAM_END) {
+		if (gbc->cpu.dma.timer > 0) {
+			gbcc_memory_dma_sync(gbc);
+		}
 		return gbc->memory.oam[addr - OAM_START];
 	} else if (addr >= IOREG_START && addr < IOREG_END) {
 		return gbc->memory.ioreg[addr - IOREG_START];
@@ -130,43 +252,15 @@ uint8_t gbcc_memory_read_force(struct gbcc_core *gbc, uint16_t addr) {
 
 uint8_t gbcc_memory_read(struct gbcc_core *gbc, uint16_t addr)
 {
-	if (addr < ROMX_END || (addr >= SRAM_START && addr < SRAM_END)) {
-		uint8_t ret;
-		switch (gbc->cart.mbc.type) {
-			case NONE:
-				ret = gbcc_mbc_none_read(gbc, addr);
-				break;
-			case MBC1:
-				ret = gbcc_mbc_mbc1_read(gbc, addr);
-				break;
-			case MBC2:
-				ret = gbcc_mbc_mbc2_read(gbc, addr);
-				break;
-			case MBC3:
-				ret = gbcc_mbc_mbc3_read(gbc, addr);
-				break;
-			case MBC5:
-				ret = gbcc_mbc_mbc5_read(gbc, addr);
-				break;
-			case MBC6:
-				ret = gbcc_mbc_mbc6_read(gbc, addr);
-				break;
-			case MBC7:
-				ret = gbcc_mbc_mbc7_read(gbc, addr);
-				break;
-			case HUC1:
-				ret = gbcc_mbc_huc1_read(gbc, addr);
-				break;
-			case HUC3:
-				ret = gbcc_mbc_huc3_read(gbc, addr);
-				break;
-			case MMM01:
-				ret = gbcc_mbc_mmm01_read(gbc, addr);
-				break;
-			case CAMERA:
-				ret = gbcc_mbc_cam_read(gbc, addr);
-				break;
+	const uint8_t *page = gbc->memory.read_map[addr >> 8u];
+	if (page != NULL) {
+		if (addr < ROMX_END && gbc->cheats.enabled) {
+			return gbcc_cheats_gamegenie_read(gbc, addr, page[addr & 0xFFu]);
 		}
+		return page[addr & 0xFFu];
+	}
+	if (addr < ROMX_END || (addr >= SRAM_START && addr < SRAM_END)) {
+		uint8_t ret = gbc->cart.mbc.ops->read(gbc, addr);
 		if (addr < ROMX_END && gbc->cheats.enabled) {
 			return gbcc_cheats_gamegenie_read(gbc, addr, ret);
 		}
@@ -203,7 +297,11 @@ uint8_t gbcc_memory_read(struct gbcc_core *gbc, uint16_t addr)
 ANDROID_INLINE
 void gbcc_memory_write_force(struct gbcc_core *gbc, uint16_t addr, uint8_t val) {
 	if (addr >= OAM_START && addr < OAM_END) {
+		if (gbc->cpu.dma.timer > 0) {
+			gbcc_memory_dma_sync(gbc);
+		}
 		gbc->memory.oam[addr - OAM_START] = val;
+		gbc->ppu.sprite_lines.dirty = true;
 	} else if (addr >= IOREG_START && addr < IOREG_END) {
 		gbc->memory.ioreg[addr - IOREG_START] = val;
 	} else {
@@ -213,46 +311,26 @@ void gbcc_memory_write_force(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 
 void gbcc_memory_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 {
+	if (gbc->cpu.dma.timer > 0) {
+		/* The write could change bytes that DMA has yet to copy */
+		gbcc_memory_dma_sync(gbc);
+	}
+	uint8_t *page = gbc->memory.write_map[addr >> 8u];
+	if (page != NULL) {
+		/* Only VRAM & WRAM are mapped, and WRAM may hold code */
+		if (addr >= WRAM0_START) {
+			gbcc_icache_ram_write(gbc, addr);
+		} else {
+			gbcc_tile_cache_write(gbc, addr);
+		}
+		page[addr & 0xFFu] = val;
+		return;
+	}
 	if (addr < ROMX_END || (addr >= SRAM_START && addr < SRAM_END)) {
 		if (addr >= SRAM_START && addr < SRAM_END) {
-			gbc->cart.mbc.last_save_time = time(NULL);
-			gbc->cart.mbc.sram_changed = true;
-		}
-		switch (gbc->cart.mbc.type) {
-			case NONE:
-				gbcc_mbc_none_write(gbc, addr, val);
-				break;
-			case MBC1:
-				gbcc_mbc_mbc1_write(gbc, addr, val);
-				break;
-			case MBC2:
-				gbcc_mbc_mbc2_write(gbc, addr, val);
-				break;
-			case MBC3:
-				gbcc_mbc_mbc3_write(gbc, addr, val);
-				break;
-			case MBC5:
-				gbcc_mbc_mbc5_write(gbc, addr, val);
-				break;
-			case MBC6:
-				gbcc_mbc_mbc6_write(gbc, addr, val);
-				break;
-			case MBC7:
-				gbcc_mbc_mbc7_write(gbc, addr, val);
-				break;
-			case HUC1:
-				gbcc_mbc_huc1_write(gbc, addr, val);
-				break;
-			case HUC3:
-				gbcc_mbc_huc3_write(gbc, addr, val);
-				break;
-			case MMM01:
-				gbcc_mbc_mmm01_write(gbc, addr, val);
-				break;
-			case CAMERA:
-				gbcc_mbc_cam_write(gbc, addr, val);
-				break;
+			sram_mark_dirty(gbc, addr);
 		}
+		gbc->cart.mbc.ops->write(gbc, addr, val);
 		return;
 	}
 	if (addr >= VRAM_START && addr < VRAM_END) {
@@ -271,6 +349,7 @@ void gbcc_memory_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 		hram_write(gbc, addr, val);
 	} else if (addr == IE) {
 		gbc->memory.iereg = val;
+		update_interrupts(gbc);
 	} else {
 		gbcc_log_error("Writing to unknown memory address %04X.\n", addr);
 	}
@@ -281,8 +360,11 @@ uint8_t vram_read(struct gbcc_core *gbc, uint16_t addr)
 	return gbc->memory.vram[addr - VRAM_START];
 }
 
+/* VRAM is only unmapped while the PPU has drawn the current line ahead */
 void vram_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 {
+	gbcc_ppu_invalidate_line(gbc);
+	gbcc_tile_cache_write(gbc, addr);
 	gbc->memory.vram[addr - VRAM_START] = val;
 }
 
@@ -296,6 +378,7 @@ uint8_t wram_read(struct gbcc_core *gbc, uint16_t addr)
 
 void wram_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 {
+	gbcc_icache_ram_write(gbc, addr);
 	if (addr < WRAMX_START) {
 		gbc->memory.wram0[addr - WRAM0_START] = val;
 	} else {
@@ -331,6 +414,7 @@ void oam_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 		return;
 	}
 	gbc->memory.oam[addr - OAM_START] = val;
+	gbc->ppu.sprite_lines.dirty = true;
 }
 
 uint8_t unused_read(struct gbcc_core *gbc, uint16_t addr)
@@ -354,199 +438,256 @@ void unused_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 }
 
 uint8_t ioreg_read(struct gbcc_core *gbc, uint16_t addr)
+{
+	const struct ioreg_handler *handler = &ioreg_handlers[addr - IOREG_START];
+	if (handler->read != NULL) {
+		return handler->read(gbc, addr);
+	}
+	return gbc->memory.ioreg[addr - IOREG_START] | (uint8_t)~read_mask(gbc, addr);
+}
+
+void ioreg_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	const struct ioreg_handler *handler = &ioreg_handlers[addr - IOREG_START];
+	if (handler->write != NULL) {
+		handler->write(gbc, addr, val);
+		return;
+	}
+	gbc->memory.ioreg[addr - IOREG_START] = write_value(gbc, addr, val);
+}
+
+uint8_t read_mask(struct gbcc_core *gbc, uint16_t addr)
 {
 	uint8_t mask = ioreg_read_masks[addr - IOREG_START];
-	uint8_t ret = gbc->memory.ioreg[addr - IOREG_START];
+	/* Ignore GBC-specific registers when in DMG mode */
+	if (gbc->mode == DMG) {
+		mask &= ~ioreg_dmg_masks[addr - IOREG_START];
+	}
+	return mask;
+}
 
+/* The new value of a register, keeping any bits that can't be written */
+uint8_t write_value(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	uint8_t mask = ioreg_write_masks[addr - IOREG_START];
 	/* Ignore GBC-specific registers when in DMG mode */
 	if (gbc->mode == DMG) {
 		mask &= ~ioreg_dmg_masks[addr - IOREG_START];
 	}
+	uint8_t tmp = gbc->memory.ioreg[addr - IOREG_START] & (uint8_t)~mask;
+	return tmp | (uint8_t)(val & mask);
+}
 
+uint8_t joyp_read(struct gbcc_core *gbc, uint16_t addr)
+{
+	/* Only update the keys when we actually want to read from them */
+	uint8_t ret = gbc->memory.ioreg[addr - IOREG_START];
+	ret |= 0x0Fu;
+	if (!check_bit(ret, 5)) {
+		ret &= (uint8_t)~(uint8_t)(gbc->keys.start << 3u);
+		ret &= (uint8_t)~(uint8_t)(gbc->keys.select << 2u);
+		ret &= (uint8_t)~(uint8_t)(gbc->keys.b << 1u);
+		ret &= (uint8_t)~(uint8_t)(gbc->keys.a << 0u);
+	}
+	if (!check_bit(ret, 4)) {
+		ret &= (uint8_t)~(uint8_t)(gbc->keys.dpad.down << 3u);
+		ret &= (uint8_t)~(uint8_t)(gbc->keys.dpad.up << 2u);
+		ret &= (uint8_t)~(uint8_t)(gbc->keys.dpad.left << 1u);
+		ret &= (uint8_t)~(uint8_t)(gbc->keys.dpad.right << 0u);
+	}
+	gbc->memory.ioreg[addr - IOREG_START] = ret;
+	return ret | (uint8_t)~read_mask(gbc, addr);
+}
 
-	if (addr >= WAVE_START && addr < WAVE_END) {
+void joyp_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	uint8_t *dest = &gbc->memory.ioreg[addr - IOREG_START];
+	*dest &= 0x0Fu;
+	*dest |= val;
+}
+
+void sc_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	uint8_t *dest = &gbc->memory.ioreg[addr - IOREG_START];
+	*dest = write_value(gbc, addr, val);
+	if (gbc->link_cable.state == GBCC_LINK_CABLE_STATE_LOOPBACK) {
+		*dest = clear_bit(*dest, 7);
+		gbcc_memory_set_bit(gbc, IF, 3);
+		return;
+	}
+	if (check_bit(val, 1)) {
+		gbc->link_cable.divider = 16;
+	} else {
+		gbc->link_cable.divider = 512;
+	}
+	if (!check_bit(val, 7)) {
+		return;
+	}
+	if (!check_bit(val, 0)) {
 		/*
-		 * When the wave channel is enabled, accessing any wave RAM
-		 * accesses the current byte.
+		 * Externally clocked transfer,
+		 * do nothing for now.
 		 */
-		if (gbc->apu.ch3.enabled) {
-			return gbc->memory.ioreg[gbc->apu.wave.addr - IOREG_START];
-		}
+		return;
 	}
-
-	switch (addr) {
-		case LY:
-			if (gbc->ppu.lcd_disable) {
-				return 0;
-			}
-			break;
-		case JOYP:
-			/* Only update the keys when we actually want to read from them */
-			ret |= 0x0Fu;
-			if (!check_bit(ret, 5)) {
-				ret &= (uint8_t)~(uint8_t)(gbc->keys.start << 3u);
-				ret &= (uint8_t)~(uint8_t)(gbc->keys.select << 2u);
-				ret &= (uint8_t)~(uint8_t)(gbc->keys.b << 1u);
-				ret &= (uint8_t)~(uint8_t)(gbc->keys.a << 0u);
-			}
-			if (!check_bit(ret, 4)) {
-				ret &= (uint8_t)~(uint8_t)(gbc->keys.dpad.down << 3u);
-				ret &= (uint8_t)~(uint8_t)(gbc->keys.dpad.up << 2u);
-				ret &= (uint8_t)~(uint8_t)(gbc->keys.dpad.left << 1u);
-				ret &= (uint8_t)~(uint8_t)(gbc->keys.dpad.right << 0u);
-			}
-			gbc->memory.ioreg[addr - IOREG_START] = ret;
-			break;
-		case DIV:
-			return high_byte(gbc->cpu.div_timer);
-		case NR52:
-			ret &= 0xF0u;
-			ret |= (uint8_t)(gbc->apu.ch1.enabled << 0u);
-			ret |= (uint8_t)(gbc->apu.ch2.enabled << 1u);
-			ret |= (uint8_t)(gbc->apu.ch3.enabled << 2u);
-			ret |= (uint8_t)(gbc->apu.ch4.enabled << 3u);
-			ret |= (uint8_t)(!gbc->apu.disabled << 7u);
+	/* Clock the transfer on every CPU cycle until it's done */
+	gbcc_scheduler_schedule(gbc, GBCC_EVENT_SERIAL, gbc->scheduler.time);
+	//fprintf(stderr, "%c\n", gbc->memory.ioreg[SB - IOREG_START]);
+	//fprintf(stdout, "0x%02X\n", gbc->memory.ioreg[SB - IOREG_START]);
+	/*
+	 * If link_cable_loop is true, just receive SB.
+	 * This means the gameboy acts like it's
+	 * talking to an exact clone of itself.
+	 */
+	switch (gbc->link_cable.state) {
+		case GBCC_LINK_CABLE_STATE_DISCONNECTED:
+			gbc->link_cable.received = 0xFFu;
 			break;
-		case BGPD:
-			ret = gbc->ppu.bgp[gbc->memory.ioreg[BGPI - IOREG_START] & 0x3Fu];
+		case GBCC_LINK_CABLE_STATE_LOOPBACK:
+			gbc->link_cable.received = gbc->memory.ioreg[SB - IOREG_START];
 			break;
-		case OBPD:
-			ret = gbc->ppu.obp[gbc->memory.ioreg[OBPI - IOREG_START] & 0x3Fu];
+		case GBCC_LINK_CABLE_STATE_PRINTER:
+			gbc->link_cable.received = gbcc_printer_parse_byte(&gbc->printer, gbc->memory.ioreg[SB - IOREG_START]);
 			break;
 		default:
-			ret = gbc->memory.ioreg[addr - IOREG_START];
 			break;
 	}
-	return ret | (uint8_t)~mask;
 }
 
-void ioreg_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+void timer_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 {
-	/*
-	if (addr == LCDC) {
-		printf("LCDC = 0b");
-		for (int i = 7; i >= 0; i--) {
-			printf("%u", check_bit(val, i));
-		}
-		printf("\n");
+	gbcc_timer_write(gbc, addr, write_value(gbc, addr, val));
+}
+
+void if_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	gbc->memory.ioreg[addr - IOREG_START] = write_value(gbc, addr, val);
+	update_interrupts(gbc);
+}
+
+void apu_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	if (addr != NR52 && gbc->apu.disabled) {
+		return;
 	}
-	if (addr == STAT) {
-		printf("STAT = 0b");
-		val |= ~ioreg_read_masks[addr - IOREG_START];
-		for (int i = 7; i >= 0; i--) {
-			printf("%u", check_bit(val, i));
-		}
-		printf(" (0x%02X)\n", val);
+	gbc->memory.ioreg[addr - IOREG_START] = write_value(gbc, addr, val);
+	gbcc_apu_memory_write(gbc, addr, val);
+}
+
+uint8_t nr52_read(struct gbcc_core *gbc, uint16_t addr)
+{
+	uint8_t ret = gbc->memory.ioreg[addr - IOREG_START];
+	ret &= 0xF0u;
+	ret |= (uint8_t)(gbc->apu.ch1.enabled << 0u);
+	ret |= (uint8_t)(gbc->apu.ch2.enabled << 1u);
+	ret |= (uint8_t)(gbc->apu.ch3.enabled << 2u);
+	ret |= (uint8_t)(gbc->apu.ch4.enabled << 3u);
+	ret |= (uint8_t)(!gbc->apu.disabled << 7u);
+	return ret | (uint8_t)~read_mask(gbc, addr);
+}
+
+/*
+ * When the wave channel is enabled, accessing any wave RAM accesses the
+ * current byte.
+ */
+uint8_t wave_read(struct gbcc_core *gbc, uint16_t addr)
+{
+	if (gbc->apu.ch3.enabled) {
+		gbcc_apu_sync(gbc);
+		return gbc->memory.ioreg[gbc->apu.wave.addr - IOREG_START];
 	}
-	*/
+	return gbc->memory.ioreg[addr - IOREG_START] | (uint8_t)~read_mask(gbc, addr);
+}
 
-	uint8_t *dest = &gbc->memory.ioreg[addr - IOREG_START];
-	uint8_t mask = ioreg_write_masks[addr - IOREG_START];
-	/* Ignore GBC-specific registers when in DMG mode */
-	if (gbc->mode == DMG) {
-		mask &= ~ioreg_dmg_masks[addr - IOREG_START];
+void wave_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	if (gbc->apu.ch3.enabled) {
+		gbcc_apu_sync(gbc);
+		gbc->memory.ioreg[gbc->apu.wave.addr - IOREG_START] = val;
 	}
-	uint8_t tmp = *dest & (uint8_t)~mask;
-	
-	if (addr >= WAVE_START && addr < WAVE_END) {
-		/*
-		 * When the wave channel is enabled, accessing any wave RAM
-		 * accesses the current byte.
-		 */
-		if (gbc->apu.ch3.enabled) {
-			gbc->memory.ioreg[gbc->apu.wave.addr - IOREG_START] = val;
-		}
+	gbc->memory.ioreg[addr - IOREG_START] = write_value(gbc, addr, val);
+}
+
+void lcdc_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	gbcc_ppu_invalidate_line(gbc);
+	if (check_bit(val, 7)) {
+		gbcc_enable_lcd(gbc);
+	} else {
+		gbcc_disable_lcd(gbc);
 	}
+	gbc->memory.ioreg[addr - IOREG_START] = write_value(gbc, addr, val);
+	gbcc_ppu_reschedule(gbc);
+}
 
-	if (addr >= NR10 && addr <= NR52) {
-		if (addr != NR52 && gbc->apu.disabled) {
-			return;
-		}
-		*dest = tmp | (uint8_t)(val & mask);
-		gbcc_apu_memory_write(gbc, addr, val);
-		return;
+void stat_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	gbc->memory.ioreg[addr - IOREG_START] = write_value(gbc, addr, val);
+	gbcc_ppu_reschedule(gbc);
+}
+
+uint8_t ly_read(struct gbcc_core *gbc, uint16_t addr)
+{
+	if (gbc->ppu.lcd_disable) {
+		return 0;
+	}
+	return gbc->memory.ioreg[addr - IOREG_START] | (uint8_t)~read_mask(gbc, addr);
+}
+
+void ly_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	gbc->memory.ioreg[addr - IOREG_START] = 0;
+	gbcc_ppu_reschedule(gbc);
+}
+
+void lyc_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	gbc->memory.ioreg[addr - IOREG_START] = write_value(gbc, addr, val);
+	gbc->ppu.lyc = val;
+	gbcc_ppu_reschedule(gbc);
+}
+
+void dma_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	/* Sprites disappear while DMA is running */
+	gbcc_ppu_invalidate_line(gbc);
+	gbc->cpu.dma.new_source = (uint16_t)(val << 8u);
+	if (gbc->cpu.dma.new_source > WRAMX_END) {
+		/* Can't DMA from ECHO or IOREG areas */
+		gbc->cpu.dma.new_source -= 0x2000u;
 	}
+	gbc->cpu.dma.requested = true;
+	gbc->memory.ioreg[addr - IOREG_START] = write_value(gbc, addr, val);
+}
+
+/* BGP, OBP0 & OBP1 are read by the PPU for every pixel */
+void palette_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	gbcc_ppu_invalidate_line(gbc);
+	gbc->memory.ioreg[addr - IOREG_START] = write_value(gbc, addr, val);
+	gbcc_ppu_update_dmg_colours(gbc);
+}
 
+void vbk_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	uint8_t bank = write_value(gbc, addr, val);
+	gbc->memory.ioreg[addr - IOREG_START] = bank;
+	gbc->memory.vram = gbc->memory.vram_bank[bank];
+	gbcc_memory_map_vram(gbc);
+}
+
+uint8_t hdma_read(struct gbcc_core *gbc, uint16_t addr)
+{
+	gbcc_hdma_sync(gbc);
+	return gbc->memory.ioreg[addr - IOREG_START] | (uint8_t)~read_mask(gbc, addr);
+}
+
+/* HDMA1-4 */
+void hdma_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	gbcc_hdma_sync(gbc);
+	uint8_t *dest = &gbc->memory.ioreg[addr - IOREG_START];
 	switch (addr) {
-		case LY:
-			*dest = 0;
-			break;
-		case JOYP:
-			*dest &= 0x0Fu;
-			*dest |= val;
-			break;
-		case SC:
-			*dest = tmp | (val & mask);
-			if (gbc->link_cable.state == GBCC_LINK_CABLE_STATE_LOOPBACK) {
-				*dest = clear_bit(*dest, 7);
-				gbcc_memory_set_bit(gbc, IF, 3);
-				return;
-			}
-			if (check_bit(val, 1)) {
-				gbc->link_cable.divider = 16;
-			} else {
-				gbc->link_cable.divider = 512;
-			}
-			if (check_bit(val, 7)) {
-				if (!check_bit(val, 0)) {
-					/*
-					 * Externally clocked transfer,
-					 * do nothing for now.
-					 */
-					return;
-				}
-				//fprintf(stderr, "%c\n", gbc->memory.ioreg[SB - IOREG_START]);
-				//fprintf(stdout, "0x%02X\n", gbc->memory.ioreg[SB - IOREG_START]);
-				/*
-				 * If link_cable_loop is true, just receive SB.
-				 * This means the gameboy acts like it's
-				 * talking to an exact clone of itself.
-				 */
-				switch (gbc->link_cable.state) {
-					case GBCC_LINK_CABLE_STATE_DISCONNECTED:
-						gbc->link_cable.received = 0xFFu;
-						break;
-					case GBCC_LINK_CABLE_STATE_LOOPBACK:
-						gbc->link_cable.received = gbc->memory.ioreg[SB - IOREG_START];
-						break;
-					case GBCC_LINK_CABLE_STATE_PRINTER:
-						gbc->link_cable.received = gbcc_printer_parse_byte(&gbc->printer, gbc->memory.ioreg[SB - IOREG_START]);
-						break;
-					default:
-						break;
-				}
-				return;
-			}
-			break;
-		case DIV:
-			//printf("DIV reset from %04X\n", gbc->div_timer);
-			gbc->cpu.div_timer = 0;
-			break;
-		case LCDC:
-			if (check_bit(val, 7)) {
-				gbcc_enable_lcd(gbc);
-			} else {
-				gbcc_disable_lcd(gbc);
-			}
-			*dest = tmp | (uint8_t)(val & mask);
-			break;
-		case LYC:
-			*dest = tmp | (uint8_t)(val & mask);
-			gbc->ppu.lyc = val;
-			break;
-		case DMA:
-			gbc->cpu.dma.new_source = (uint16_t)(val << 8u);
-			if (gbc->cpu.dma.new_source > WRAMX_END) {
-				/* Can't DMA from ECHO or IOREG areas */
-				gbc->cpu.dma.new_source -= 0x2000u;
-			}
-			gbc->cpu.dma.requested = true;
-			*dest = tmp | (uint8_t)(val & mask);
-			break;
-		case VBK:
-			*dest = tmp | (uint8_t)(val & mask);
-			gbc->memory.vram = gbc->memory.vram_bank[*dest];
-			break;
 		case HDMA1:
 			if (val < 0x80u || (val >= 0xA0u && val < 0xE0u)) {
 				*dest = val;
@@ -567,90 +708,109 @@ void ioreg_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 			/* Lower 4 bits of destination are ignored */
 			*dest = val & 0xF0u;
 			break;
-		case HDMA5:
-			{
-				if (!check_bit(val, 7)) {
-					if (gbc->hdma.length > 0) {
-						gbc->hdma.length = 0;
-						gbc->hdma.to_copy = 0;
-						*dest |= 0x80u;
-						return;
-					}
-				}
-				uint8_t src_hi = gbc->memory.ioreg[HDMA1 - IOREG_START];
-				uint8_t src_lo = gbc->memory.ioreg[HDMA2 - IOREG_START];
-				uint8_t dst_hi = gbc->memory.ioreg[HDMA3 - IOREG_START];
-				uint8_t dst_lo = gbc->memory.ioreg[HDMA4 - IOREG_START];
-				gbc->hdma.source = cat_bytes(src_lo, src_hi);
-				gbc->hdma.dest = cat_bytes(dst_lo, dst_hi);
-				gbc->hdma.length = ((val & 0x7Fu) + 1u) * 0x10u;
-				/* Top bit is is set to 0 to indicate running */
-				*dest = val & 0x7Fu;
-				if (check_bit(val, 7)) {
-					/* H-Blank DMA */
-					gbc->hdma.hblank = true;
-					/*
-					 * When started in HBLANK or while the
-					 * screen is off, one block is copied
-					 * immediately.
-					 */
-					uint8_t stat = gbc->memory.ioreg[STAT - IOREG_START];
-					if ((stat & 0x03u) == GBC_LCD_MODE_HBLANK) {
-						gbc->hdma.to_copy = 0x10u;
-					}
-					if (gbc->ppu.lcd_disable) {
-						gbc->hdma.to_copy = 0x10u;
-					}
-				} else {
-					/* General DMA */
-					gbc->hdma.to_copy = gbc->hdma.length;
-					gbc->hdma.hblank = false;
-				}
-			}
-			break;
-		case RP:
-			/* TODO: Handle */
-			break;
-		case BGPD:
-			{
-				uint8_t index = gbc->memory.ioreg[BGPI - IOREG_START];
-				gbc->ppu.bgp[index & 0x3Fu] = val;
-				if (check_bit(index, 7)) {
-					index++;
-					if ((index & 0x7Fu) == 0x40u) {
-						index = bit(7);
-					}
-					gbc->memory.ioreg[BGPI - IOREG_START] = index;
-				}
-			}
-			break;
-		case OBPD:
-			{
-				uint8_t index = gbc->memory.ioreg[OBPI - IOREG_START];
-				gbc->ppu.obp[index & 0x3Fu] = val;
-				if (check_bit(index, 7)) {
-					index++;
-					if ((index & 0x7Fu) == 0x40u) {
-						index = bit(7);
-					}
-					gbc->memory.ioreg[OBPI - IOREG_START] = index;
-				}
-			}
-			break;
-		case SVBK:
-			{
-				uint8_t bank = tmp | (val & mask);
-				bank += !bank;
-				*dest = bank;
-				gbc->memory.wramx = gbc->memory.wram_bank[bank];
-			}
-			break;
 		default:
-			*dest = tmp | (uint8_t)(val & mask);
 			break;
 	}
 }
 
+void hdma5_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	gbcc_hdma_sync(gbc);
+	uint8_t *dest = &gbc->memory.ioreg[addr - IOREG_START];
+	if (!check_bit(val, 7)) {
+		if (gbc->hdma.length > 0) {
+			gbc->hdma.length = 0;
+			gbc->hdma.to_copy = 0;
+			*dest |= 0x80u;
+			return;
+		}
+	}
+	uint8_t src_hi = gbc->memory.ioreg[HDMA1 - IOREG_START];
+	uint8_t src_lo = gbc->memory.ioreg[HDMA2 - IOREG_START];
+	uint8_t dst_hi = gbc->memory.ioreg[HDMA3 - IOREG_START];
+	uint8_t dst_lo = gbc->memory.ioreg[HDMA4 - IOREG_START];
+	gbc->hdma.source = cat_bytes(src_lo, src_hi);
+	gbc->hdma.dest = cat_bytes(dst_lo, dst_hi);
+	gbc->hdma.length = ((val & 0x7Fu) + 1u) * 0x10u;
+	/* Top bit is is set to 0 to indicate running */
+	*dest = val & 0x7Fu;
+	if (check_bit(val, 7)) {
+		/* H-Blank DMA */
+		gbc->hdma.hblank = true;
+		/*
+		 * When started in HBLANK or while the screen is off, one
+		 * block is copied immediately.
+		 */
+		uint8_t stat = gbc->memory.ioreg[STAT - IOREG_START];
+		if ((stat & 0x03u) == GBC_LCD_MODE_HBLANK) {
+			gbc->hdma.to_copy = 0x10u;
+		}
+		if (gbc->ppu.lcd_disable) {
+			gbc->hdma.to_copy = 0x10u;
+		}
+	} else {
+		/* General DMA */
+		gbc->hdma.to_copy = gbc->hdma.length;
+		gbc->hdma.hblank = false;
+	}
+}
+
+void rp_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	/* TODO: Handle */
+}
+
+uint8_t bgpd_read(struct gbcc_core *gbc, uint16_t addr)
+{
+	uint8_t ret = gbc->ppu.bgp[gbc->memory.ioreg[BGPI - IOREG_START] & 0x3Fu];
+	return ret | (uint8_t)~read_mask(gbc, addr);
+}
+
+void bgpd_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	gbcc_ppu_invalidate_line(gbc);
+	uint8_t index = gbc->memory.ioreg[BGPI - IOREG_START];
+	gbc->ppu.bgp[index & 0x3Fu] = val;
+	gbcc_ppu_update_cgb_colour(gbc, false, index & 0x3Fu);
+	if (check_bit(index, 7)) {
+		index++;
+		if ((index & 0x7Fu) == 0x40u) {
+			index = bit(7);
+		}
+		gbc->memory.ioreg[BGPI - IOREG_START] = index;
+	}
+}
+
+uint8_t obpd_read(struct gbcc_core *gbc, uint16_t addr)
+{
+	uint8_t ret = gbc->ppu.obp[gbc->memory.ioreg[OBPI - IOREG_START] & 0x3Fu];
+	return ret | (uint8_t)~read_mask(gbc, addr);
+}
+
+void obpd_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	gbcc_ppu_invalidate_line(gbc);
+	uint8_t index = gbc->memory.ioreg[OBPI - IOREG_START];
+	gbc->ppu.obp[index & 0x3Fu] = val;
+	gbcc_ppu_update_cgb_colour(gbc, true, index & 0x3Fu);
+	if (check_bit(index, 7)) {
+		index++;
+		if ((index & 0x7Fu) == 0x40u) {
+			index = bit(7);
+		}
+		gbc->memory.ioreg[OBPI - IOREG_START] = index;
+	}
+}
+
+void svbk_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	uint8_t bank = write_value(gbc, addr, val);
+	bank += !bank;
+	gbc->memory.ioreg[addr - IOREG_START] = bank;
+	gbc->memory.wramx = gbc->memory.wram_bank[bank];
+	map_wram(gbc);
+}
+
 uint8_t hram_read(struct gbcc_core *gbc, uint16_t addr)
 {
 	return gbc->memory.hram[addr - HRAM_START];
@@ -658,13 +818,124 @@ uint8_t hram_read(struct gbcc_core *gbc, uint16_t addr)
 
 void hram_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
 {
+	gbcc_icache_ram_write(gbc, addr);
 	gbc->memory.hram[addr - HRAM_START] = val;
 }
 
+/*
+ * Cache which interrupts are both enabled & requested, so that the CPU
+ * doesn't have to read IE & IF every cycle.
+ */
+void update_interrupts(struct gbcc_core *gbc)
+{
+	uint8_t ifreg = gbc->memory.ioreg[IF - IOREG_START];
+	gbc->cpu.interrupt.pending = gbc->memory.iereg & ifreg & 0x1Fu;
+}
+
+/*
+ * OAM DMA counts off one byte per M-cycle, but only copies them once
+ * something could tell the difference: OAM being read, a write that could
+ * change the source, or the DMA finishing. Runs from mapped pages are copied
+ * in one go.
+ */
+void gbcc_memory_dma_sync(struct gbcc_core *gbc)
+{
+	struct cpu *cpu = &gbc->cpu;
+	uint8_t done = (uint8_t)(DMA_TIMER - cpu->dma.timer);
+	if (low_byte(cpu->dma.source) < done) {
+		gbc->ppu.sprite_lines.dirty = true;
+	}
+	while (low_byte(cpu->dma.source) < done) {
+		uint8_t offset = low_byte(cpu->dma.source);
+		const uint8_t *page = gbc->memory.read_map[cpu->dma.source >> 8u];
+		bool patched = cpu->dma.source < ROMX_END && gbc->cheats.enabled;
+		if (page != NULL && !patched) {
+			memcpy(gbc->memory.oam + offset, page + offset, done - offset);
+			cpu->dma.source += done - offset;
+		} else {
+			gbc->memory.oam[offset] = gbcc_memory_read(gbc, cpu->dma.source);
+			cpu->dma.source++;
+		}
+	}
+}
+
+/*
+ * Record a write to the SRAM area for autosaving. This only notes which page
+ * of cartridge RAM is currently mapped there, as writes may just as well be
+ * to an RTC or similar, and the frontend works out when to save.
+ */
+void sram_mark_dirty(struct gbcc_core *gbc, uint16_t addr)
+{
+	struct gbcc_mbc *mbc = &gbc->cart.mbc;
+	mbc->sram_changed = true;
+	if (gbc->cart.ram_size == 0 || gbc->memory.sram == NULL) {
+		return;
+	}
+	size_t offset = (size_t)(gbc->memory.sram - gbc->cart.ram) + (addr - SRAM_START);
+	size_t page = (offset % gbc->cart.ram_size) / GBCC_SRAM_PAGE_SIZE;
+	mbc->sram_dirty[page / 8] = set_bit(mbc->sram_dirty[page / 8], page % 8);
+}
+
+/*
+ * Rebuild the whole memory map from the currently selected banks, e.g. after
+ * loading a save state.
+ */
+void gbcc_memory_remap(struct gbcc_core *gbc)
+{
+	for (size_t i = 0; i < N_ELEM(gbc->memory.read_map); i++) {
+		gbc->memory.read_map[i] = NULL;
+		gbc->memory.write_map[i] = NULL;
+	}
+	gbcc_memory_map_rom(gbc);
+	gbcc_memory_map_vram(gbc);
+	map_wram(gbc);
+}
+
+/*
+ * Called whenever the MBC switches ROM banks. Writes to ROM always go to the
+ * MBC, and SRAM is left to the MBC entirely, as whether it can be accessed
+ * (and what's there) depends on the MBC's state.
+ */
+void gbcc_memory_map_rom(struct gbcc_core *gbc)
+{
+	/* MBC6 maps ROM in half-banks, and isn't implemented anyway */
+	bool direct = gbc->cart.mbc.type != MBC6;
+	map_pages(gbc, ROM0_START, ROM0_SIZE, direct ? gbc->memory.rom0 : NULL, NULL);
+	map_pages(gbc, ROMX_START, ROMX_SIZE, direct ? gbc->memory.romx : NULL, NULL);
+}
+
+/*
+ * Called whenever the VRAM bank changes, or the PPU starts or stops drawing a
+ * line ahead of time, during which writes have to go through vram_write().
+ */
+void gbcc_memory_map_vram(struct gbcc_core *gbc)
+{
+	uint8_t *write = gbc->ppu.drawn_ahead ? NULL : gbc->memory.vram;
+	map_pages(gbc, VRAM_START, VRAM_SIZE, gbc->memory.vram, write);
+}
+
+void map_wram(struct gbcc_core *gbc)
+{
+	map_pages(gbc, WRAM0_START, WRAM0_SIZE, gbc->memory.wram0, gbc->memory.wram0);
+	map_pages(gbc, WRAMX_START, WRAMX_SIZE, gbc->memory.wramx, gbc->memory.wramx);
+	/* Writes to echo RAM have to tell the icache the real address */
+	map_pages(gbc, ECHO_START, WRAM0_SIZE, gbc->memory.wram0, NULL);
+	map_pages(gbc, ECHO_START + WRAM0_SIZE, ECHO_SIZE - WRAM0_SIZE, gbc->memory.wramx, NULL);
+}
+
+void map_pages(struct gbcc_core *gbc, uint16_t start, uint16_t size, const uint8_t *read, uint8_t *write)
+{
+	for (uint16_t offset = 0; offset < size; offset += 0x100u) {
+		gbc->memory.read_map[(start + offset) >> 8u] = (read != NULL) ? read + offset : NULL;
+		gbc->memory.write_map[(start + offset) >> 8u] = (write != NULL) ? write + offset : NULL;
+	}
+}
+
 void gbcc_link_cable_clock(struct gbcc_core *gbc)
 {
 	uint8_t sc = gbcc_memory_read_force(gbc, SC);
 	if (!check_bit(sc, 7) || !check_bit(sc, 0)) {
+		gbcc_scheduler_cancel(gbc, GBCC_EVENT_SERIAL);
 		return;
 	}
 	uint8_t sb = gbcc_memory_read_force(gbc, SB);
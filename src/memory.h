@@ -25,6 +25,12 @@ uint8_t gbcc_memory_read_force(struct gbcc_core *gbc, uint16_t addr);
 void gbcc_memory_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
 void gbcc_memory_write_force(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
 
+void gbcc_memory_dma_sync(struct gbcc_core *gbc);
+
+void gbcc_memory_remap(struct gbcc_core *gbc);
+void gbcc_memory_map_rom(struct gbcc_core *gbc);
+void gbcc_memory_map_vram(struct gbcc_core *gbc);
+
 void gbcc_link_cable_clock(struct gbcc_core *gbc);
 
 #endif /* GBCC_MEMORY_H */
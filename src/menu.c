@@ -13,6 +13,7 @@
 #include "input.h"
 #include "menu.h"
 #include "nelem.h"
+#include "ppu.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -233,7 +234,7 @@ void toggle_option(struct gbcc *gbc, enum gbcc_key key)
 				} else {
 					p_idx++;
 				}
-				gbc->core.ppu.palette = gbcc_get_palette_by_index(p_idx % GBCC_NUM_PALETTES);
+				gbcc_ppu_set_palette(&gbc->core, gbcc_get_palette_by_index(p_idx % GBCC_NUM_PALETTES));
 			}
 			break;
 		case GBCC_MENU_ENTRY_CHEATS:
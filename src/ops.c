@@ -15,6 +15,7 @@
 #include "debug.h"
 #include "memory.h"
 #include "ops.h"
+#include "timer.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -124,6 +125,191 @@ void (*const gbcc_ops[0x100])(struct gbcc_core *gbc) = {
 /* 0xFC */	INVALID,	INVALID,	ALU_OP,		RST
 };
 
+/*
+ * Memory accessed by each opcode, used to check whether it's safe to execute
+ * an instruction all at once.
+ */
+const uint8_t gbcc_op_access[0x100] = {
+/* 0x00 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_BC,		GBCC_ACCESS_NONE,
+/* 0x04 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x08 */	GBCC_ACCESS_OTHER,	GBCC_ACCESS_NONE,	GBCC_ACCESS_BC,		GBCC_ACCESS_NONE,
+/* 0x0C */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x10 */	GBCC_ACCESS_OTHER,	GBCC_ACCESS_NONE,	GBCC_ACCESS_DE,		GBCC_ACCESS_NONE,
+/* 0x14 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x18 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_DE,		GBCC_ACCESS_NONE,
+/* 0x1C */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x20 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x24 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x28 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x2C */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x30 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x34 */	GBCC_ACCESS_HL,		GBCC_ACCESS_HL,		GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x38 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x3C */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x40 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x44 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x48 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x4C */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x50 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x54 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x58 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x5C */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x60 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x64 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x68 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x6C */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x70 */	GBCC_ACCESS_HL,		GBCC_ACCESS_HL,		GBCC_ACCESS_HL,		GBCC_ACCESS_HL,
+/* 0x74 */	GBCC_ACCESS_HL,		GBCC_ACCESS_HL,		GBCC_ACCESS_OTHER,	GBCC_ACCESS_HL,
+/* 0x78 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x7C */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x80 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x84 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x88 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x8C */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x90 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x94 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0x98 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0x9C */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0xA0 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0xA4 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0xA8 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0xAC */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0xB0 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0xB4 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0xB8 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0xBC */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_HL,		GBCC_ACCESS_NONE,
+/* 0xC0 */	GBCC_ACCESS_STACK,	GBCC_ACCESS_STACK,	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,
+/* 0xC4 */	GBCC_ACCESS_STACK,	GBCC_ACCESS_STACK,	GBCC_ACCESS_NONE,	GBCC_ACCESS_STACK,
+/* 0xC8 */	GBCC_ACCESS_STACK,	GBCC_ACCESS_STACK,	GBCC_ACCESS_NONE,	GBCC_ACCESS_CB,
+/* 0xCC */	GBCC_ACCESS_STACK,	GBCC_ACCESS_STACK,	GBCC_ACCESS_NONE,	GBCC_ACCESS_STACK,
+/* 0xD0 */	GBCC_ACCESS_STACK,	GBCC_ACCESS_STACK,	GBCC_ACCESS_NONE,	GBCC_ACCESS_OTHER,
+/* 0xD4 */	GBCC_ACCESS_STACK,	GBCC_ACCESS_STACK,	GBCC_ACCESS_NONE,	GBCC_ACCESS_STACK,
+/* 0xD8 */	GBCC_ACCESS_STACK,	GBCC_ACCESS_OTHER,	GBCC_ACCESS_NONE,	GBCC_ACCESS_OTHER,
+/* 0xDC */	GBCC_ACCESS_STACK,	GBCC_ACCESS_OTHER,	GBCC_ACCESS_NONE,	GBCC_ACCESS_STACK,
+/* 0xE0 */	GBCC_ACCESS_OTHER,	GBCC_ACCESS_STACK,	GBCC_ACCESS_OTHER,	GBCC_ACCESS_OTHER,
+/* 0xE4 */	GBCC_ACCESS_OTHER,	GBCC_ACCESS_STACK,	GBCC_ACCESS_NONE,	GBCC_ACCESS_STACK,
+/* 0xE8 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_OTHER,	GBCC_ACCESS_OTHER,
+/* 0xEC */	GBCC_ACCESS_OTHER,	GBCC_ACCESS_OTHER,	GBCC_ACCESS_NONE,	GBCC_ACCESS_STACK,
+/* 0xF0 */	GBCC_ACCESS_OTHER,	GBCC_ACCESS_STACK,	GBCC_ACCESS_OTHER,	GBCC_ACCESS_NONE,
+/* 0xF4 */	GBCC_ACCESS_OTHER,	GBCC_ACCESS_STACK,	GBCC_ACCESS_NONE,	GBCC_ACCESS_STACK,
+/* 0xF8 */	GBCC_ACCESS_NONE,	GBCC_ACCESS_NONE,	GBCC_ACCESS_OTHER,	GBCC_ACCESS_NONE,
+/* 0xFC */	GBCC_ACCESS_OTHER,	GBCC_ACCESS_OTHER,	GBCC_ACCESS_NONE,	GBCC_ACCESS_STACK
+};
+
+/* Length in bytes of each instruction, including the opcode */
+const uint8_t gbcc_op_lengths[0x100] = {
+/* 0x00 */	1, 3, 1, 1, 1, 1, 2, 1,
+/* 0x08 */	3, 1, 1, 1, 1, 1, 2, 1,
+/* 0x10 */	2, 3, 1, 1, 1, 1, 2, 1,
+/* 0x18 */	2, 1, 1, 1, 1, 1, 2, 1,
+/* 0x20 */	2, 3, 1, 1, 1, 1, 2, 1,
+/* 0x28 */	2, 1, 1, 1, 1, 1, 2, 1,
+/* 0x30 */	2, 3, 1, 1, 1, 1, 2, 1,
+/* 0x38 */	2, 1, 1, 1, 1, 1, 2, 1,
+/* 0x40 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x48 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x50 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x58 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x60 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x68 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x70 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x78 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x80 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x88 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x90 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0x98 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0xA0 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0xA8 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0xB0 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0xB8 */	1, 1, 1, 1, 1, 1, 1, 1,
+/* 0xC0 */	1, 1, 3, 3, 3, 1, 2, 1,
+/* 0xC8 */	1, 1, 3, 2, 3, 3, 2, 1,
+/* 0xD0 */	1, 1, 3, 1, 3, 1, 2, 1,
+/* 0xD8 */	1, 1, 3, 1, 3, 1, 2, 1,
+/* 0xE0 */	2, 1, 1, 1, 1, 1, 2, 1,
+/* 0xE8 */	2, 1, 3, 1, 1, 1, 2, 1,
+/* 0xF0 */	2, 1, 1, 1, 1, 1, 2, 1,
+/* 0xF8 */	2, 1, 3, 1, 1, 1, 2, 1
+};
+
+/*
+ * Maximum number of M-cycles taken by each instruction, i.e. when any branch is
+ * taken. For 0xCB, this is the longest of the CB-prefixed instructions.
+ */
+const uint8_t gbcc_op_times[0x100] = {
+/* 0x00 */	1, 3, 2, 2, 1, 1, 2, 1,
+/* 0x08 */	5, 2, 2, 2, 1, 1, 2, 1,
+/* 0x10 */	1, 3, 2, 2, 1, 1, 2, 1,
+/* 0x18 */	3, 2, 2, 2, 1, 1, 2, 1,
+/* 0x20 */	3, 3, 2, 2, 1, 1, 2, 1,
+/* 0x28 */	3, 2, 2, 2, 1, 1, 2, 1,
+/* 0x30 */	3, 3, 2, 2, 3, 3, 3, 1,
+/* 0x38 */	3, 2, 2, 2, 1, 1, 2, 1,
+/* 0x40 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0x48 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0x50 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0x58 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0x60 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0x68 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0x70 */	2, 2, 2, 2, 2, 2, 1, 2,
+/* 0x78 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0x80 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0x88 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0x90 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0x98 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0xA0 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0xA8 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0xB0 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0xB8 */	1, 1, 1, 1, 1, 1, 2, 1,
+/* 0xC0 */	5, 3, 4, 4, 6, 4, 2, 4,
+/* 0xC8 */	5, 4, 4, 4, 6, 6, 2, 4,
+/* 0xD0 */	5, 3, 4, 1, 6, 4, 2, 4,
+/* 0xD8 */	5, 4, 4, 1, 6, 1, 2, 4,
+/* 0xE0 */	3, 3, 2, 1, 1, 4, 2, 4,
+/* 0xE8 */	4, 1, 4, 1, 1, 1, 2, 4,
+/* 0xF0 */	3, 3, 2, 1, 1, 4, 2, 4,
+/* 0xF8 */	3, 2, 4, 1, 1, 1, 2, 4
+};
+
+/*
+ * Instructions which end a block for the block executor, either because they
+ * change control flow or affect interrupts.
+ */
+const bool gbcc_op_ends_block[0x100] = {
+/* 0x00 */	false, false, false, false, false, false, false, false,
+/* 0x08 */	false, false, false, false, false, false, false, false,
+/* 0x10 */	true, false, false, false, false, false, false, false,
+/* 0x18 */	true, false, false, false, false, false, false, false,
+/* 0x20 */	true, false, false, false, false, false, false, false,
+/* 0x28 */	true, false, false, false, false, false, false, false,
+/* 0x30 */	true, false, false, false, false, false, false, false,
+/* 0x38 */	true, false, false, false, false, false, false, false,
+/* 0x40 */	false, false, false, false, false, false, false, false,
+/* 0x48 */	false, false, false, false, false, false, false, false,
+/* 0x50 */	false, false, false, false, false, false, false, false,
+/* 0x58 */	false, false, false, false, false, false, false, false,
+/* 0x60 */	false, false, false, false, false, false, false, false,
+/* 0x68 */	false, false, false, false, false, false, false, false,
+/* 0x70 */	false, false, false, false, false, false, true, false,
+/* 0x78 */	false, false, false, false, false, false, false, false,
+/* 0x80 */	false, false, false, false, false, false, false, false,
+/* 0x88 */	false, false, false, false, false, false, false, false,
+/* 0x90 */	false, false, false, false, false, false, false, false,
+/* 0x98 */	false, false, false, false, false, false, false, false,
+/* 0xA0 */	false, false, false, false, false, false, false, false,
+/* 0xA8 */	false, false, false, false, false, false, false, false,
+/* 0xB0 */	false, false, false, false, false, false, false, false,
+/* 0xB8 */	false, false, false, false, false, false, false, false,
+/* 0xC0 */	true, false, true, true, true, false, false, true,
+/* 0xC8 */	true, true, true, false, true, true, false, true,
+/* 0xD0 */	true, false, true, false, true, false, false, true,
+/* 0xD8 */	true, true, true, false, true, false, false, true,
+/* 0xE0 */	false, false, false, false, false, false, false, true,
+/* 0xE8 */	false, true, false, false, false, false, false, true,
+/* 0xF0 */	false, false, false, true, false, false, false, true,
+/* 0xF8 */	false, false, false, true, false, false, false, true
+};
+
 
 void INTERRUPT(struct gbcc_core *gbc)
 {
@@ -137,9 +323,7 @@ void INTERRUPT(struct gbcc_core *gbc)
 		done(cpu);
 		return;
 	}
-	uint8_t iereg = gbcc_memory_read(gbc, IE);
-	uint8_t ifreg = gbcc_memory_read(gbc, IF);
-	uint8_t interrupt = (uint8_t)(iereg & ifreg) & 0x1Fu;
+	uint8_t interrupt = cpu->interrupt.pending;
 	if (!interrupt && cpu->instruction.step < 4) {
 		if (cpu->instruction.step < 3) {
 			cpu->interrupt.request = false;
@@ -241,7 +425,7 @@ void STOP(struct gbcc_core *gbc)
 {
 	uint8_t key1 = gbcc_memory_read_force(gbc, KEY1);
 	if (gbc->mode == GBC && check_bit(key1, 0)) {
-		gbc->cpu.double_speed = !gbc->cpu.double_speed;
+		gbcc_timer_switch_speed(gbc);
 		key1 = gbc->cpu.double_speed * bit(7);
 		gbcc_memory_write_force(gbc, KEY1, key1);
 	} else {
@@ -254,9 +438,7 @@ void STOP(struct gbcc_core *gbc)
 void HALT(struct gbcc_core *gbc)
 {
 	struct cpu *cpu = &gbc->cpu;
-	uint8_t iereg = gbcc_memory_read(gbc, IE);
-	uint8_t ifreg = gbcc_memory_read(gbc, IF);
-	bool interrupt = (uint8_t)(iereg & ifreg) & 0x1Fu;
+	bool interrupt = cpu->interrupt.pending;
 	if (cpu->ime) {
 		/* HALT proceeds normally */
 		cpu->halt.set = true;
@@ -12,10 +12,25 @@
 #define GBCC_OPS_H
 
 #include "core.h"
+#include <stdbool.h>
 #include <stdint.h>
 
+/* Memory (other than the instruction stream) accessed by each opcode */
+enum gbcc_op_access {
+	GBCC_ACCESS_NONE,
+	GBCC_ACCESS_HL,
+	GBCC_ACCESS_BC,
+	GBCC_ACCESS_DE,
+	GBCC_ACCESS_STACK,
+	GBCC_ACCESS_CB,		/* Depends on the following CB opcode */
+	GBCC_ACCESS_OTHER
+};
+
 extern void (*const gbcc_ops[0x100])(struct gbcc_core *gbc);
 extern const uint8_t gbcc_op_times[0x100];
+extern const uint8_t gbcc_op_access[0x100];
+extern const uint8_t gbcc_op_lengths[0x100];
+extern const bool gbcc_op_ends_block[0x100];
 
 /* Not really an opcode, but behaves like a cpu instruction */
 void INTERRUPT(struct gbcc_core *gbc);
@@ -11,61 +11,72 @@
 #include "core.h"
 #include "bit_utils.h"
 #include "colour.h"
+#include "composite.h"
 #include "debug.h"
 #include "gbcc.h"
 #include "memory.h"
 #include "palettes.h"
 #include "ppu.h"
+#include "scheduler.h"
+#include "tile_cache.h"
+#include "triple_buffer.h"
 #include <stdio.h>
 #include <string.h>
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
-#define BACKGROUND_MAP_BANK_1 0x9800u
-#define BACKGROUND_MAP_BANK_2 0x9C00u
+/*
+ * Lines to draw a pixel at a time after one drawn ahead had to be redrawn, as
+ * games that write mid-line tend to do so on several lines in a row.
+ */
+#define REDRAW_BACKOFF 8
 
-/* 
- * Guide to line buffer attribute bits:
- * 0 - is this pixel being drawn?
- * 1 - is this colour 0?
- * 2 - priority bit
+/*
+ * Most frames in a row to leave undrawn in automatic frame skip mode, so
+ * that something still gets drawn if nothing is presenting them.
  */
+#define MAX_AUTO_FRAME_SKIP 9
+
+/* 64-bit FNV-1a parameters, used a word at a time for line hashes */
+#define HASH_SEED 0xCBF29CE484222325u
+#define HASH_PRIME 0x100000001B3u
 
-#define ATTR_DRAWN (bit(0))
-#define ATTR_COLOUR0 (bit(1))
-#define ATTR_PRIORITY (bit(2))
+#define BACKGROUND_MAP_BANK_1 0x9800u
+#define BACKGROUND_MAP_BANK_2 0x9C00u
 
 enum palette_flag { BACKGROUND, SPRITE_1, SPRITE_2 };
 
 static void draw_background_pixel(struct gbcc_core *gbc);
 static void draw_window_pixel(struct gbcc_core *gbc);
 static void draw_sprite_pixel(struct gbcc_core *gbc);
-static void composite_line(struct gbcc_core *gbc);
+static void draw_pixel(struct gbcc_core *gbc);
+static bool can_draw_ahead(struct gbcc_core *gbc);
+static void draw_ahead(struct gbcc_core *gbc);
 static uint8_t get_video_mode(uint8_t stat);
 static uint8_t set_video_mode(uint8_t stat, uint8_t mode);
-static uint32_t get_palette_colour(struct gbcc_core *gbc, uint8_t palette, uint8_t n, enum palette_flag pf);
+static uint8_t colour_index(struct gbcc_core *gbc, uint8_t palette, uint8_t n, enum palette_flag pf);
+static void set_pixel(struct gbcc_core *gbc, struct line_buffer *line, uint8_t index);
+static uint32_t cgb_colour(uint8_t lo, uint8_t hi);
 static void load_bg_tile(struct gbcc_core *gbc);
 static void load_window_tile(struct gbcc_core *gbc);
 static void load_sprite_tile(struct gbcc_core *gbc, int n);
-static uint8_t get_tile_pixel(uint8_t hi, uint8_t lo, uint8_t x, bool flip);
+static void sort_sprites(struct gbcc_core *gbc, bool double_size);
+static void output_line(struct gbcc_core *gbc);
+static uint64_t hash_line(uint64_t hash, const void *data, size_t len);
+static void blank_frame(struct gbcc_core *gbc);
+static void publish_frame(struct gbcc_core *gbc);
+static bool skip_next_frame(struct gbcc_core *gbc);
+static uint32_t next_event_dot(struct gbcc_core *gbc);
 
 void gbcc_disable_lcd(struct gbcc_core *gbc)
 {
 	struct ppu *ppu = &gbc->ppu;
-	if (gbc->mode == GBC) {
-		memset(ppu->screen.sdl, 0xFFu, GBC_SCREEN_SIZE * sizeof(*ppu->screen.buffer_0));
-	} else {
-		uint32_t colour = get_palette_colour(gbc, 0, 0, BACKGROUND);
-		for (int y = 0; y < GBC_SCREEN_HEIGHT; y++) {
-			for (int x = 0; x < GBC_SCREEN_WIDTH; x++) {
-				ppu->screen.sdl[y * GBC_SCREEN_WIDTH + x] = colour;
-			}
-		}
-		for (int y = 0; y < GBC_SCREEN_HEIGHT; y++) {
-			for (int x = 0; x < GBC_SCREEN_WIDTH; x++) {
-				ppu->screen.gbc[y * GBC_SCREEN_WIDTH + x] = colour;
-			}
-		}
+	gbcc_ppu_sync(gbc);
+	/* Show a blank screen until the LCD is turned back on */
+	blank_frame(gbc);
+	publish_frame(gbc);
+	if (gbc->mode == DMG) {
+		blank_frame(gbc);
 	}
 	ppu->lcd_disable = true;
 	ppu->ly = 0;
@@ -82,6 +93,7 @@ void gbcc_disable_lcd(struct gbcc_core *gbc)
 void gbcc_enable_lcd(struct gbcc_core *gbc)
 {
 	struct ppu *ppu = &gbc->ppu;
+	gbcc_ppu_sync(gbc);
 	if (!ppu->lcd_disable) {
 		return;
 	}
@@ -95,6 +107,144 @@ void gbcc_enable_lcd(struct gbcc_core *gbc)
 	ppu->clock = 248;
 }
 
+/*
+ * Most dots don't do anything apart from increment the clock, so rather than
+ * clocking the PPU every cycle, the scheduler only calls this on the dots
+ * that do, and the clock is caught up on the ones in between.
+ */
+void gbcc_ppu_event(struct gbcc_core *gbc)
+{
+	struct ppu *ppu = &gbc->ppu;
+	uint64_t now = gbc->scheduler.time;
+	if (!ppu->lcd_disable) {
+		ppu->clock += (uint32_t)((now - ppu->sync_time) / 2 - 1);
+	}
+	ppu->sync_time = now;
+
+	gbcc_ppu_clock(gbc);
+
+	if (ppu->lcd_disable) {
+		gbcc_scheduler_cancel(gbc, GBCC_EVENT_PPU);
+		return;
+	}
+	uint32_t dots = next_event_dot(gbc) - ppu->clock + 1;
+	gbcc_scheduler_schedule(gbc, GBCC_EVENT_PPU, now + 2 * dots);
+}
+
+void gbcc_ppu_sync(struct gbcc_core *gbc)
+{
+	struct ppu *ppu = &gbc->ppu;
+	uint64_t now = GBCC_SCHEDULER_DOT(gbc->scheduler.time);
+	if (!ppu->lcd_disable) {
+		ppu->clock += (uint32_t)((now - ppu->sync_time) / 2);
+	}
+	ppu->sync_time = now;
+}
+
+/*
+ * Called after a write to a register that affects the PPU's timing (e.g.
+ * STAT or LYC), so that it gets a chance to react on the next dot.
+ */
+void gbcc_ppu_reschedule(struct gbcc_core *gbc)
+{
+	gbcc_ppu_sync(gbc);
+	gbcc_scheduler_schedule(gbc, GBCC_EVENT_PPU, gbc->ppu.sync_time + 2);
+}
+
+/*
+ * Called just before anything is written which could change how the current
+ * line is drawn. If the line was drawn ahead of time, it's put back how it was
+ * at the start of mode 3, and drawn again a pixel at a time up to now.
+ */
+void gbcc_ppu_invalidate_line(struct gbcc_core *gbc)
+{
+	struct ppu *ppu = &gbc->ppu;
+	if (!ppu->drawn_ahead) {
+		return;
+	}
+	gbcc_ppu_sync(gbc);
+	ppu->drawn_ahead = false;
+	ppu->redraw_backoff = REDRAW_BACKOFF;
+	gbcc_memory_map_vram(gbc);
+
+	memset(ppu->bg_line.attr, 0, sizeof(ppu->bg_line.attr));
+	memset(ppu->window_line.attr, 0, sizeof(ppu->window_line.attr));
+	memset(ppu->sprite_line.attr, 0, sizeof(ppu->sprite_line.attr));
+	for (int i = 0; i < ppu->n_sprites; i++) {
+		ppu->sprites[i].loaded = false;
+	}
+	ppu->bg_tile = ppu->line_start.bg_tile;
+	ppu->window_tile.x = 0;
+	ppu->window_ly = ppu->line_start.window_ly;
+	ppu->x = 0;
+	ppu->next_dot = ppu->line_start.next_dot;
+
+	/* Every dot before ppu->clock has already happened */
+	while (ppu->x < GBC_SCREEN_WIDTH && ppu->next_dot < ppu->clock) {
+		draw_pixel(gbc);
+	}
+	gbcc_ppu_reschedule(gbc);
+}
+
+void gbcc_ppu_set_palette(struct gbcc_core *gbc, struct palette palette)
+{
+	gbc->ppu.palette = palette;
+	gbcc_ppu_update_dmg_colours(gbc);
+}
+
+/* Called once the core is set up, when none of the cached colours are valid */
+void gbcc_ppu_update_colours(struct gbcc_core *gbc)
+{
+	for (uint8_t i = 0; i < sizeof(gbc->ppu.bgp); i += 2) {
+		gbcc_ppu_update_cgb_colour(gbc, false, i);
+		gbcc_ppu_update_cgb_colour(gbc, true, i);
+	}
+	gbcc_ppu_update_dmg_colours(gbc);
+}
+
+/*
+ * Called after a write to BGP, OBP0 or OBP1, or a change of palette. This
+ * also sets the colours which don't come from the game's palettes.
+ */
+void gbcc_ppu_update_dmg_colours(struct gbcc_core *gbc)
+{
+	struct ppu *ppu = &gbc->ppu;
+	ppu->colours[GBCC_COLOUR_WHITE] = 0xFFFFFFFFu;
+	ppu->colours[GBCC_COLOUR_LCD_OFF] = 0xFFFFFFFFu;
+	if (gbc->mode != DMG) {
+		return;
+	}
+	ppu->colours[GBCC_COLOUR_LCD_OFF] = ppu->palette.background[0];
+	ppu->colours_changed = true;
+	uint8_t bgp = gbcc_memory_read_force(gbc, BGP);
+	uint8_t obp0 = gbcc_memory_read_force(gbc, OBP0);
+	uint8_t obp1 = gbcc_memory_read_force(gbc, OBP1);
+	for (uint8_t n = 0; n < 4; n++) {
+		ppu->colours[n] = ppu->palette.background[(bgp >> (2 * n)) & 0x03u];
+		ppu->colours[GBCC_COLOUR_SPRITE + n] = ppu->palette.sprite2[(obp0 >> (2 * n)) & 0x03u];
+		ppu->colours[GBCC_COLOUR_SPRITE + 4 + n] = ppu->palette.sprite1[(obp1 >> (2 * n)) & 0x03u];
+	}
+}
+
+/* Called after a write to byte index of the CGB background or sprite palettes */
+void gbcc_ppu_update_cgb_colour(struct gbcc_core *gbc, bool sprite, uint8_t index)
+{
+	struct ppu *ppu = &gbc->ppu;
+	if (gbc->mode == DMG) {
+		/* These colours belong to the DMG palettes instead */
+		return;
+	}
+	const uint8_t *data = sprite ? ppu->obp : ppu->bgp;
+	index &= 0x3Eu;
+	/* 4 colours of 2 bytes each per palette */
+	uint8_t n = index / 2;
+	if (sprite) {
+		n += GBCC_COLOUR_SPRITE;
+	}
+	ppu->colours[n] = cgb_colour(data[index], data[index + 1]);
+	ppu->colours_changed = true;
+}
+
 ANDROID_INLINE
 void gbcc_ppu_clock(struct gbcc_core *gbc)
 {
@@ -136,24 +286,20 @@ void gbcc_ppu_clock(struct gbcc_core *gbc)
 		 */
 		stat = set_video_mode(stat, GBC_LCD_MODE_OAM_READ);
 
-		ppu->n_sprites = 0;
+		if (gbc->cpu.dma.timer > 0) {
+			gbcc_memory_dma_sync(gbc);
+		}
 		bool double_size = check_bit(ppu->lcdc, 2); /* 8x8 or 8x16 tiles */
-		for (uint16_t addr = OAM_START; addr < OAM_END; addr += 4) {
-			uint8_t y = gbcc_memory_read_force(gbc, addr);
-			uint8_t x = gbcc_memory_read_force(gbc, addr + 1);
-			if (ppu->ly >= y || ppu->ly + 16 < y || (!double_size && ppu->ly + 8 >= y)) {
-				/* Sprite isn't on this line */
-				continue;
-			}
-			ppu->sprites[ppu->n_sprites].y = y;
-			ppu->sprites[ppu->n_sprites].x = x;
-			ppu->sprites[ppu->n_sprites].address = addr;
-			ppu->sprites[ppu->n_sprites].loaded = false;
-			ppu->n_sprites++;
-			/* GameBoy can only draw 10 sprites per line */
-			if (ppu->n_sprites == 10) {
-				break;
-			}
+		if (ppu->sprite_lines.dirty || ppu->sprite_lines.double_size != double_size) {
+			sort_sprites(gbc, double_size);
+		}
+		ppu->n_sprites = ppu->sprite_lines.count[ppu->ly];
+		for (int i = 0; i < ppu->n_sprites; i++) {
+			uint8_t n = ppu->sprite_lines.index[ppu->ly][i];
+			ppu->sprites[i].y = gbc->memory.oam[4 * n];
+			ppu->sprites[i].x = gbc->memory.oam[4 * n + 1];
+			ppu->sprites[i].address = OAM_START + 4 * n;
+			ppu->sprites[i].loaded = false;
 		}
 	}
 	if (ppu->clock == 81 && get_video_mode(stat) != GBC_LCD_MODE_VBLANK) {
@@ -183,20 +329,30 @@ void gbcc_ppu_clock(struct gbcc_core *gbc)
 		ppu->next_dot = 94 + ppu->scx % 8;
 		ppu->bg_tile.x = ppu->scx % 8;
 		ppu->window_tile.x = 0;
+		if (can_draw_ahead(gbc)) {
+			draw_ahead(gbc);
+		}
 	}
 	if (get_video_mode(stat) == GBC_LCD_MODE_OAM_VRAM_READ) {
-		if (ppu->x == 160) {
+		if (ppu->x < 160) {
+			if (ppu->clock == ppu->next_dot) {
+				draw_pixel(gbc);
+			}
+		} else if (!ppu->drawn_ahead || ppu->clock == ppu->next_dot) {
+			if (ppu->drawn_ahead) {
+				ppu->drawn_ahead = false;
+				gbcc_memory_map_vram(gbc);
+				ppu->fast_lines++;
+			} else {
+				ppu->slow_lines++;
+			}
 			stat = set_video_mode(stat, GBC_LCD_MODE_HBLANK);
-			composite_line(gbc);
+			if (!ppu->skip_frame) {
+				output_line(gbc);
+			}
 			if (gbc->hdma.hblank && gbc->hdma.length > 0) {
 				gbc->hdma.to_copy = 0x10u;
 			}
-		} else if (ppu->clock == ppu->next_dot) {
-			draw_background_pixel(gbc);
-			draw_window_pixel(gbc);
-			draw_sprite_pixel(gbc);
-			ppu->x++;
-			ppu->next_dot++;
 		}
 	}
 	
@@ -229,14 +385,15 @@ void gbcc_ppu_clock(struct gbcc_core *gbc)
 		stat = set_video_mode(stat, GBC_LCD_MODE_VBLANK);
 
 		if (gbc->sync_to_video && !gbc->keys.turbo) {
-			sem_wait(&ppu->vsync_semaphore);
+			gbcc_triple_buffer_wait(ppu->screen.frames);
 		}
 
-		uint32_t *tmp = ppu->screen.gbc;
-		ppu->screen.gbc = ppu->screen.sdl;
-		ppu->screen.sdl = tmp;
+		if (!ppu->skip_frame) {
+			publish_frame(gbc);
+		}
 
 		ppu->frame++;
+		ppu->skip_frame = skip_next_frame(gbc);
 
 		/*
 		 * Apparently, the window "remembers" how many lines it drew
@@ -298,14 +455,9 @@ void draw_background_pixel(struct gbcc_core *gbc)
 		load_bg_tile(gbc);
 	}
 
-	uint8_t colour = get_tile_pixel(t->hi, t->lo, t->x, check_bit(t->attr, 5));
-	uint8_t palette;
-	if (gbc->mode == DMG) {
-		palette = gbcc_memory_read_force(gbc, BGP);
-	} else {
-		palette = t->attr & 0x07u;
-	}
-	ppu->bg_line.colour[ppu->x] = get_palette_colour(gbc, palette, colour, BACKGROUND);
+	uint8_t colour = t->pixels[t->x];
+	uint8_t palette = t->attr & 0x07u;
+	set_pixel(gbc, &ppu->bg_line, colour_index(gbc, palette, colour, BACKGROUND));
 
 	uint8_t attr = ATTR_DRAWN;
 	if (colour == 0) {
@@ -342,14 +494,9 @@ void draw_window_pixel(struct gbcc_core *gbc)
 		}
 	}
 
-	uint8_t colour = get_tile_pixel(t->hi, t->lo, t->x, check_bit(t->attr, 5));
-	uint8_t palette;
-	if (gbc->mode == DMG) {
-		palette = gbcc_memory_read_force(gbc, BGP);
-	} else {
-		palette = t->attr & 0x07u;
-	}
-	ppu->window_line.colour[ppu->x] = get_palette_colour(gbc, palette, colour, BACKGROUND);
+	uint8_t colour = t->pixels[t->x];
+	uint8_t palette = t->attr & 0x07u;
+	set_pixel(gbc, &ppu->window_line, colour_index(gbc, palette, colour, BACKGROUND));
 	uint8_t attr = ATTR_DRAWN;
 	if (colour == 0) {
 		attr |= ATTR_COLOUR0;
@@ -398,26 +545,18 @@ void draw_sprite_pixel(struct gbcc_core *gbc)
 			ppu->next_dot += 11 - MIN(5, (ppu->x + ppu->scx) % 8);
 		}
 		uint8_t x = ppu->x + 8 - s->x;
-		uint8_t colour = get_tile_pixel(s->tile.hi, s->tile.lo, x, check_bit(s->tile.attr, 5));
+		uint8_t colour = s->tile.pixels[x];
 		/* Colour 0 is transparent */
 		if (!colour) {
 			continue;
 		}
-		uint8_t palette;
-		enum palette_flag pf;
-		if (gbc->mode == DMG) {
-			if (check_bit(s->tile.attr, 4)) {
-				palette = gbcc_memory_read_force(gbc, OBP1);
-				pf = SPRITE_1;
-			} else {
-				palette = gbcc_memory_read_force(gbc, OBP0);
-				pf = SPRITE_2;
-			}
-		} else {
-			palette = s->tile.attr & 0x07u;
-			pf = SPRITE_1;
+		uint8_t palette = s->tile.attr & 0x07u;
+		enum palette_flag pf = SPRITE_1;
+		if (gbc->mode == DMG && !check_bit(s->tile.attr, 4)) {
+			/* OBP0 */
+			pf = SPRITE_2;
 		}
-		ppu->sprite_line.colour[ppu->x] = get_palette_colour(gbc, palette, colour, pf);
+		set_pixel(gbc, &ppu->sprite_line, colour_index(gbc, palette, colour, pf));
 		uint8_t attr = ATTR_DRAWN;
 		if (check_bit(s->tile.attr, 7)) {
 			attr |= ATTR_PRIORITY;
@@ -426,62 +565,174 @@ void draw_sprite_pixel(struct gbcc_core *gbc)
 	}
 }
 
-void composite_line(struct gbcc_core *gbc)
+void draw_pixel(struct gbcc_core *gbc)
 {
-	/* 
-	 * Composite the line according to various attributes. In order of
-	 * increasing priority, these are:
-	 * ob_attr & ATTR_PRIORITY: if set, draw sprites below background
-	 * 			    colours 1-3
-	 * (win|bg)_attr & ATTR_PRIORITY: same as above
-	 * bit(ppu->lcdc, 0): TODO: different for DMG & GBC
-	 */
 	struct ppu *ppu = &gbc->ppu;
-	uint8_t ly = ppu->ly;
-	uint32_t *line = &ppu->screen.gbc[ly * GBC_SCREEN_WIDTH];
+	if (!ppu->skip_frame) {
+		draw_background_pixel(gbc);
+		draw_window_pixel(gbc);
+	}
+	/* Sprites are still needed in skipped frames, as they delay mode 3 */
+	draw_sprite_pixel(gbc);
+	ppu->x++;
+	ppu->next_dot++;
+}
 
-	if (!gbc->hide_background) {
-		memcpy(line, ppu->bg_line.colour, GBC_SCREEN_WIDTH * sizeof(line[0]));
-	} else {
-		memset(line, 0xFFu, GBC_SCREEN_WIDTH * sizeof(line[0]));
+/*
+ * Cycle-accurate mode keeps drawing a pixel per dot, as do the lines just
+ * after a redraw. While OAM DMA is going, sprites could be switched on or off
+ * part way through the line.
+ */
+bool can_draw_ahead(struct gbcc_core *gbc)
+{
+	const struct cpu *cpu = &gbc->cpu;
+	if (gbc->cycle_accurate) {
+		return false;
+	}
+	if (gbc->ppu.redraw_backoff > 0) {
+		gbc->ppu.redraw_backoff--;
+		return false;
 	}
-	for (uint8_t x = 0; x < GBC_SCREEN_WIDTH; x++) {
-		uint8_t bg_attr = ppu->bg_line.attr[x];
-		uint8_t win_attr = ppu->window_line.attr[x];
-		uint8_t ob_attr = ppu->sprite_line.attr[x];
+	return !cpu->dma.running && cpu->dma.timer == 0 && !cpu->dma.requested;
+}
 
-		if (win_attr & ATTR_DRAWN && !gbc->hide_window) {
-			line[x] = ppu->window_line.colour[x];
-			if (win_attr & ATTR_PRIORITY && !(win_attr & ATTR_COLOUR0)) {
-				continue;
-			}
+/*
+ * Draw all of a line at the start of mode 3, rather than one pixel on each
+ * of the dots that follow. The state needed to start again is saved, in case
+ * gbcc_ppu_invalidate_line() is called before mode 3 ends. Until then, VRAM is
+ * unmapped for writing, so that writes to it are noticed.
+ */
+void draw_ahead(struct gbcc_core *gbc)
+{
+	struct ppu *ppu = &gbc->ppu;
+	ppu->line_start.bg_tile = ppu->bg_tile;
+	ppu->line_start.window_ly = ppu->window_ly;
+	ppu->line_start.next_dot = ppu->next_dot;
+
+	if (ppu->skip_frame && (ppu->n_sprites == 0 || !check_bit(ppu->lcdc, 1))) {
+		/* Nothing to draw, and nothing to hold mode 3 up */
+		ppu->x = GBC_SCREEN_WIDTH;
+		ppu->next_dot += GBC_SCREEN_WIDTH;
+	} else {
+		uint16_t last_dot = ppu->next_dot;
+		while (ppu->x < GBC_SCREEN_WIDTH) {
+			last_dot = ppu->next_dot;
+			draw_pixel(gbc);
 		}
+		/* Mode 3 ends the dot after the last pixel, even if it loaded a sprite */
+		ppu->next_dot = last_dot + 1;
+	}
+	ppu->drawn_ahead = true;
+	gbcc_memory_map_vram(gbc);
+}
 
-		if (ob_attr & ATTR_DRAWN) {
-			if ((win_attr & ATTR_DRAWN)) {
-				if (win_attr & ATTR_PRIORITY) {
-					continue;
-				}
-				if (ob_attr & ATTR_PRIORITY) {
-					continue;
-				}
-			}
-			if ((bg_attr & ATTR_DRAWN)) {
-				if (bg_attr & ATTR_PRIORITY && !(bg_attr & ATTR_COLOUR0)) {
-					continue;
-				}
-				if (!(bg_attr & ATTR_COLOUR0) && (ob_attr & ATTR_PRIORITY)) {
-					continue;
-				}
-			}
-			if (gbc->hide_sprites) {
-				continue;
-			}
-			line[x] = ppu->sprite_line.colour[x];
+/* Composite the current line into the frame being drawn */
+void output_line(struct gbcc_core *gbc)
+{
+	struct ppu *ppu = &gbc->ppu;
+	struct gbcc_frame *frame = ppu->screen.frame;
+	size_t offset = ppu->ly * GBC_SCREEN_WIDTH;
+	if (!gbc->indexed_output) {
+		uint32_t *line = &frame->colours[offset];
+		gbcc_composite_line(gbc, line);
+		frame->line_hash[ppu->ly] = hash_line(HASH_SEED, line, GBC_SCREEN_WIDTH * sizeof(*line));
+		return;
+	}
+	/*
+	 * The colours are only copied once a line's finished, so a change in
+	 * the middle of a line applies to all of it.
+	 */
+	if (ppu->colours_changed || frame->n_palettes == 0) {
+		memcpy(frame->palettes[frame->n_palettes], ppu->colours, sizeof(ppu->colours));
+		frame->palette_hash = hash_line(HASH_SEED, ppu->colours, sizeof(ppu->colours));
+		frame->n_palettes++;
+		ppu->colours_changed = false;
+	}
+	uint8_t *line = &frame->indices[offset];
+	frame->line_palette[ppu->ly] = frame->n_palettes - 1;
+	gbcc_composite_line_indexed(gbc, line);
+	frame->line_hash[ppu->ly] = hash_line(frame->palette_hash, line, GBC_SCREEN_WIDTH);
+}
+
+/*
+ * A quick hash of a line (or colour table), which only has to tell it apart
+ * from whatever was there last frame. len is a multiple of 8.
+ */
+uint64_t hash_line(uint64_t hash, const void *data, size_t len)
+{
+	const uint8_t *bytes = data;
+	for (size_t i = 0; i < len; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, &bytes[i], sizeof(word));
+		hash = (hash ^ word) * HASH_PRIME;
+		hash ^= hash >> 32u;
+	}
+	return hash;
+}
+
+/* Fill the frame being drawn with the colour of a disabled LCD */
+void blank_frame(struct gbcc_core *gbc)
+{
+	struct ppu *ppu = &gbc->ppu;
+	struct gbcc_frame *frame = ppu->screen.frame;
+	uint64_t hash;
+	if (gbc->indexed_output) {
+		memset(frame->indices, GBCC_COLOUR_LCD_OFF, sizeof(frame->indices));
+		memset(frame->line_palette, 0, sizeof(frame->line_palette));
+		memcpy(frame->palettes[0], ppu->colours, sizeof(ppu->colours));
+		frame->palette_hash = hash_line(HASH_SEED, ppu->colours, sizeof(ppu->colours));
+		frame->n_palettes = 1;
+		hash = hash_line(frame->palette_hash, frame->indices, GBC_SCREEN_WIDTH);
+	} else {
+		uint32_t colour = ppu->colours[GBCC_COLOUR_LCD_OFF];
+		for (int i = 0; i < GBC_SCREEN_SIZE; i++) {
+			frame->colours[i] = colour;
 		}
+		hash = hash_line(HASH_SEED, frame->colours, GBC_SCREEN_WIDTH * sizeof(frame->colours[0]));
+	}
+	for (int y = 0; y < GBC_SCREEN_HEIGHT; y++) {
+		frame->line_hash[y] = hash;
 	}
 }
 
+/* Hand the finished frame to the frontend, and start on another */
+void publish_frame(struct gbcc_core *gbc)
+{
+	struct ppu *ppu = &gbc->ppu;
+	struct gbcc_frame *frame = ppu->screen.frame;
+	frame->indexed = gbc->indexed_output;
+	ppu->frames_hash = hash_line(ppu->frames_hash, frame->line_hash, sizeof(frame->line_hash));
+	ppu->screen.frame = gbcc_triple_buffer_publish(ppu->screen.frames);
+	ppu->screen.frame->n_palettes = 0;
+}
+
+/*
+ * Decide whether to draw the frame that's about to start. Everything but the
+ * pixels themselves still happens in a skipped frame, and the screen keeps
+ * showing the last frame that was drawn.
+ */
+bool skip_next_frame(struct gbcc_core *gbc)
+{
+	struct ppu *ppu = &gbc->ppu;
+	bool skip;
+	if (gbc->frame_skip_auto) {
+		/*
+		 * If the frontend hasn't taken the last frame drawn, it was
+		 * never seen, and neither will this one be.
+		 */
+		bool presented = gbcc_triple_buffer_taken(ppu->screen.frames);
+		skip = !presented && ppu->frames_skipped < MAX_AUTO_FRAME_SKIP;
+	} else {
+		skip = ppu->frames_skipped < gbc->frame_skip;
+	}
+	if (skip) {
+		ppu->frames_skipped++;
+	} else {
+		ppu->frames_skipped = 0;
+	}
+	return skip;
+}
+
 uint8_t get_video_mode(uint8_t stat)
 {
 	return stat & 0x03u;
@@ -494,35 +745,32 @@ uint8_t set_video_mode(uint8_t stat, uint8_t mode)
 	return stat;
 }
 
-uint32_t get_palette_colour(struct gbcc_core *gbc, uint8_t palette, uint8_t n, enum palette_flag pf)
+/* In DMG mode, palette is ignored, as there's only one of each kind */
+uint8_t colour_index(struct gbcc_core *gbc, uint8_t palette, uint8_t n, enum palette_flag pf)
 {
-	struct ppu *ppu = &gbc->ppu;
 	if (gbc->mode == DMG) {
-		uint8_t colours[4] = {
-			(palette & 0x03u) >> 0u,
-			(palette & 0x0Cu) >> 2u,
-			(palette & 0x30u) >> 4u,
-			(palette & 0xC0u) >> 6u
-		};
-		switch (pf) {
-			case BACKGROUND:
-				return ppu->palette.background[colours[n]];
-			case SPRITE_1:
-				return ppu->palette.sprite1[colours[n]];
-			case SPRITE_2:
-				return ppu->palette.sprite2[colours[n]];
-		}
+		palette = (pf == SPRITE_1);
 	}
-	uint8_t index = palette * 8;
-	uint8_t lo;
-	uint8_t hi;
-	if (pf == BACKGROUND) {
-		lo = ppu->bgp[index + 2 * n];
-		hi = ppu->bgp[index + 2 * n + 1];
+	uint8_t index = (uint8_t)(4 * palette + n);
+	if (pf != BACKGROUND) {
+		index += GBCC_COLOUR_SPRITE;
+	}
+	return index;
+}
+
+/* Store a pixel in the form the line will be output in */
+void set_pixel(struct gbcc_core *gbc, struct line_buffer *line, uint8_t index)
+{
+	struct ppu *ppu = &gbc->ppu;
+	if (gbc->indexed_output) {
+		line->index[ppu->x] = index;
 	} else {
-		lo = ppu->obp[index + 2 * n];
-		hi = ppu->obp[index + 2 * n + 1];
-	} 
+		line->colour[ppu->x] = ppu->colours[index];
+	}
+}
+
+uint32_t cgb_colour(uint8_t lo, uint8_t hi)
+{
 	uint8_t r = lo & 0x1Fu;
 	uint8_t g = ((lo & 0xE0u) >> 5u) | (uint8_t)((hi & 0x03u) << 3u);
 	uint8_t b = (hi & 0x7Cu) >> 2u;
@@ -558,19 +806,14 @@ void load_bg_tile(struct gbcc_core *gbc)
 		} else {
 			tile_addr = (uint16_t)(0x9000 + 16 * (int8_t)tile);
 		}
-		ppu->bg_tile.lo = gbcc_memory_read_force(gbc, tile_addr + line_offset);
-		ppu->bg_tile.hi = gbcc_memory_read_force(gbc, tile_addr + line_offset + 1);
+		const uint8_t *row = gbcc_tile_cache_row(gbc, 0, tile_addr - VRAM_START + line_offset, false);
+		memcpy(ppu->bg_tile.pixels, row, sizeof(ppu->bg_tile.pixels));
 		ppu->bg_tile.attr = 0;
 	} else {
 		uint8_t tile = gbc->memory.vram_bank[0][map + 32 * ty + tx - VRAM_START];
 		ppu->bg_tile.attr = gbc->memory.vram_bank[1][map + 32 * ty + tx - VRAM_START];
-		uint8_t *vbk;
+		uint8_t bank = check_bit(ppu->bg_tile.attr, 3);
 		uint16_t tile_addr;
-		if (check_bit(ppu->bg_tile.attr, 3)) {
-			vbk = gbc->memory.vram_bank[1];
-		} else {
-			vbk = gbc->memory.vram_bank[0];
-		}
 		if (check_bit(ppu->lcdc, 4)) {
 			tile_addr = 16 * tile;
 		} else {
@@ -578,12 +821,12 @@ void load_bg_tile(struct gbcc_core *gbc)
 		}
 		/* Check for Y-flip */
 		if (check_bit(ppu->bg_tile.attr, 6)) {
-			ppu->bg_tile.lo = vbk[tile_addr + (14 - line_offset)];
-			ppu->bg_tile.hi = vbk[tile_addr + (14 - line_offset) + 1];
+			tile_addr += 14 - line_offset;
 		} else {
-			ppu->bg_tile.lo = vbk[tile_addr + line_offset];
-			ppu->bg_tile.hi = vbk[tile_addr + line_offset + 1];
+			tile_addr += line_offset;
 		}
+		const uint8_t *row = gbcc_tile_cache_row(gbc, bank, tile_addr, check_bit(ppu->bg_tile.attr, 5));
+		memcpy(ppu->bg_tile.pixels, row, sizeof(ppu->bg_tile.pixels));
 	}
 }
 
@@ -610,19 +853,14 @@ void load_window_tile(struct gbcc_core *gbc)
 		} else {
 			tile_addr = (uint16_t)(0x9000 + 16 * (int8_t)tile);
 		}
-		ppu->window_tile.lo = gbcc_memory_read_force(gbc, tile_addr + line_offset);
-		ppu->window_tile.hi = gbcc_memory_read_force(gbc, tile_addr + line_offset + 1);
+		const uint8_t *row = gbcc_tile_cache_row(gbc, 0, tile_addr - VRAM_START + line_offset, false);
+		memcpy(ppu->window_tile.pixels, row, sizeof(ppu->window_tile.pixels));
 		ppu->window_tile.attr = 0;
 	} else {
 		uint8_t tile = gbc->memory.vram_bank[0][map + 32 * ty + tx - VRAM_START];
 		ppu->window_tile.attr = gbc->memory.vram_bank[1][map + 32 * ty + tx - VRAM_START];
-		uint8_t *vbk;
+		uint8_t bank = check_bit(ppu->window_tile.attr, 3);
 		uint16_t tile_addr;
-		if (check_bit(ppu->window_tile.attr, 3)) {
-			vbk = gbc->memory.vram_bank[1];
-		} else {
-			vbk = gbc->memory.vram_bank[0];
-		}
 		if (check_bit(ppu->lcdc, 4)) {
 			tile_addr = 16 * tile;
 		} else {
@@ -630,15 +868,47 @@ void load_window_tile(struct gbcc_core *gbc)
 		}
 		/* Check for Y-flip */
 		if (check_bit(ppu->window_tile.attr, 6)) {
-			ppu->window_tile.lo = vbk[tile_addr + (14 - line_offset)];
-			ppu->window_tile.hi = vbk[tile_addr + (14 - line_offset) + 1];
+			tile_addr += 14 - line_offset;
 		} else {
-			ppu->window_tile.lo = vbk[tile_addr + line_offset];
-			ppu->window_tile.hi = vbk[tile_addr + line_offset + 1];
+			tile_addr += line_offset;
 		}
+		const uint8_t *row = gbcc_tile_cache_row(gbc, bank, tile_addr, check_bit(ppu->window_tile.attr, 5));
+		memcpy(ppu->window_tile.pixels, row, sizeof(ppu->window_tile.pixels));
 	}
 }
 
+/*
+ * Work out which sprites are on each line in one pass over OAM, rather than
+ * scanning it every line. Sprite y is the bottom of a 16-pixel tall sprite,
+ * plus 1, so 8x8 sprites cover the top 8 of those lines.
+ */
+void sort_sprites(struct gbcc_core *gbc, bool double_size)
+{
+	struct ppu *ppu = &gbc->ppu;
+	memset(ppu->sprite_lines.count, 0, sizeof(ppu->sprite_lines.count));
+	for (uint8_t n = 0; n < OAM_SIZE / 4; n++) {
+		int y = gbc->memory.oam[4 * n];
+		int top = y - 16;
+		int bottom = double_size ? y - 1 : y - 9;
+		if (top < 0) {
+			top = 0;
+		}
+		if (bottom >= GBC_SCREEN_HEIGHT) {
+			bottom = GBC_SCREEN_HEIGHT - 1;
+		}
+		for (int ly = top; ly <= bottom; ly++) {
+			/* GameBoy can only draw 10 sprites per line */
+			uint8_t *count = &ppu->sprite_lines.count[ly];
+			if (*count < 10) {
+				ppu->sprite_lines.index[ly][*count] = n;
+				(*count)++;
+			}
+		}
+	}
+	ppu->sprite_lines.double_size = double_size;
+	ppu->sprite_lines.dirty = false;
+}
+
 void load_sprite_tile(struct gbcc_core *gbc, int n)
 {
 	struct ppu *ppu = &gbc->ppu;
@@ -656,11 +926,9 @@ void load_sprite_tile(struct gbcc_core *gbc, int n)
 	t->attr = gbcc_memory_read_force(gbc, ppu->sprites[n].address + 3);
 	bool yflip = check_bit(t->attr, 6);
 	uint8_t sprite_line = sy - ly;
-	uint8_t *vram_bank;
-	if (gbc->mode == DMG) {
-		vram_bank = gbc->memory.vram_bank[0];
-	} else {
-		vram_bank = gbc->memory.vram_bank[check_bit(t->attr, 3)];
+	uint8_t bank = 0;
+	if (gbc->mode == GBC) {
+		bank = check_bit(t->attr, 3);
 	}
 	if (double_size) {
 		/* 
@@ -682,16 +950,45 @@ void load_sprite_tile(struct gbcc_core *gbc, int n)
 	} else {
 		sprite_line = 16 - sprite_line;
 	}
-	t->lo = vram_bank[16 * tile + 2 * sprite_line];
-	t->hi = vram_bank[16 * tile + 2 * sprite_line + 1];
+	const uint8_t *row = gbcc_tile_cache_row(gbc, bank, 16 * tile + 2 * sprite_line, check_bit(t->attr, 5));
+	memcpy(t->pixels, row, sizeof(t->pixels));
 	t->x = 0;
 	ppu->sprites[n].loaded = true;
 }
 
-uint8_t get_tile_pixel(uint8_t hi, uint8_t lo, uint8_t x, bool flip)
+/*
+ * Returns the value of ppu->clock at the next dot on which gbcc_ppu_clock()
+ * will do any real work, which is one of:
+ * 	- the start of a scanline or of mode 3,
+ * 	- any pixel being drawn, and the end of mode 3,
+ * 	- the last dot of a line, when LY & maybe the mode change,
+ * 	- the early reset of LY on line 153.
+ * Between these, STAT & LY can only change due to CPU writes, which call
+ * gbcc_ppu_reschedule().
+ */
+uint32_t next_event_dot(struct gbcc_core *gbc)
 {
-	if (!flip) {
-		x = 7 - x;
+	struct ppu *ppu = &gbc->ppu;
+	uint8_t mode = get_video_mode(gbcc_memory_read_force(gbc, STAT));
+	uint32_t clock = ppu->clock;
+	uint32_t next = 455;
+
+	if (mode == GBC_LCD_MODE_OAM_VRAM_READ) {
+		if ((ppu->x == 160 && !ppu->drawn_ahead) || ppu->next_dot <= clock) {
+			return clock;
+		}
+		return MIN(next, ppu->next_dot);
+	}
+	if (mode != GBC_LCD_MODE_VBLANK) {
+		if (clock == 0) {
+			return clock;
+		}
+		if (clock <= 81) {
+			next = 81;
+		}
+	}
+	if (ppu->ly == 153 && clock <= 9) {
+		next = MIN(next, 9);
 	}
-	return (uint8_t)(check_bit(hi, x) << 1u) | check_bit(lo, x);
+	return next;
 }
@@ -11,22 +11,65 @@
 #ifndef GBCC_PPU_H
 #define GBCC_PPU_H
 
+#include "bit_utils.h"
 #include "constants.h"
 #include "palettes.h"
-#include <semaphore.h>
 #include <stdbool.h>
 #include <stdint.h>
 
 struct gbcc_core;
+struct gbcc_triple_buffer;
+
+/*
+ * Guide to line buffer attribute bits:
+ * 0 - is this pixel being drawn?
+ * 1 - is this colour 0?
+ * 2 - priority bit
+ */
+
+#define ATTR_DRAWN (bit(0))
+#define ATTR_COLOUR0 (bit(1))
+#define ATTR_PRIORITY (bit(2))
+
+/*
+ * The PPU's colour table, which palette indices are drawn from. The first
+ * half holds the 8 background palettes, then the 8 sprite palettes, 4
+ * colours each. DMG games use background palette 0 for BGP, and sprite
+ * palettes 0 & 1 for OBP0 & OBP1.
+ */
+#define GBCC_COLOUR_SPRITE 32
+#define GBCC_COLOUR_WHITE 64	/* Shown when the background is hidden */
+#define GBCC_COLOUR_LCD_OFF 65
+#define GBCC_COLOURS 66
 
 struct line_buffer {
 	uint32_t colour[GBC_SCREEN_WIDTH];
+	uint8_t index[GBC_SCREEN_WIDTH];	/* Used instead when indexed_output */
 	uint8_t attr[GBC_SCREEN_WIDTH];
 };
 
+/*
+ * A finished screen, either in colour, or as indices into the colour table,
+ * with a copy of the table as it was at the end of each line. Lines share
+ * copies until the colours change, so most frames only have one.
+ *
+ * Each line also has a hash of everything that decides how it looks, so
+ * that the frontend can tell which lines are the same as it last showed.
+ */
+struct gbcc_frame {
+	bool indexed;
+	uint32_t colours[GBC_SCREEN_SIZE];
+	uint8_t indices[GBC_SCREEN_SIZE];
+	uint8_t line_palette[GBC_SCREEN_HEIGHT];
+	uint8_t n_palettes;
+	/* At most one per line, plus one for the LCD being turned off */
+	uint32_t palettes[GBC_SCREEN_HEIGHT + 1][GBCC_COLOURS];
+	uint64_t palette_hash;	/* Of the newest copy */
+	uint64_t line_hash[GBC_SCREEN_HEIGHT];
+};
+
 struct tile {
-	uint8_t hi;
-	uint8_t lo;
+	uint8_t pixels[8];	/* Colour indices of the current row, as drawn */
 	uint8_t x;
 	uint8_t attr;
 };
@@ -41,21 +84,33 @@ struct sprite {
 
 struct ppu {
 	uint64_t frame;
+	uint64_t sync_time;
 	uint32_t clock;
 	bool lcd_disable;
 	uint8_t bgp[64]; 	/* 8 x 8-byte palettes */
 	uint8_t obp[64]; 	/* 8 x 8-byte palettes */
 	struct palette palette;
+	/*
+	 * Every colour the above can produce, kept up to date as they're
+	 * written, and whether they've changed since the last indexed line.
+	 */
+	uint32_t colours[GBCC_COLOURS];
+	bool colours_changed;
 	struct line_buffer bg_line;
 	struct line_buffer window_line;
 	struct line_buffer sprite_line;
 	struct {
-		uint32_t *buffer_0;
-		uint32_t *buffer_1;
-		uint32_t *gbc;
-		uint32_t *sdl;
+		/* Shared with the frontend, which shows the newest frame */
+		struct gbcc_triple_buffer *frames;
+		/* The frame being drawn, from the above */
+		struct gbcc_frame *frame;
 	} screen;
-	sem_t vsync_semaphore;
+	/*
+	 * Whether this frame's pixels are being left undrawn, and how many
+	 * frames in a row have been
+	 */
+	bool skip_frame;
+	uint8_t frames_skipped;
 
 	/* Copies of IOREG data */
 	uint8_t scy;
@@ -73,11 +128,48 @@ struct ppu {
 	uint16_t next_dot;
 	uint8_t n_sprites;
 	struct sprite sprites[10];
+	/*
+	 * OAM indices of the (up to 10) sprites on each line, in OAM order,
+	 * rebuilt at the next line whenever OAM or the sprite size changes.
+	 */
+	struct {
+		uint8_t index[GBC_SCREEN_HEIGHT][10];
+		uint8_t count[GBC_SCREEN_HEIGHT];
+		bool double_size;
+		bool dirty;
+	} sprite_lines;
 	struct tile bg_tile;
 	struct tile window_tile;
+
+	/*
+	 * Whether the rest of the current line has already been drawn, and
+	 * the state it was drawn from, in case it has to be drawn again
+	 */
+	bool drawn_ahead;
+	struct {
+		struct tile bg_tile;
+		uint8_t window_ly;
+		uint16_t next_dot;
+	} line_start;
+	/* Lines left to draw pixel by pixel after one had to be redrawn */
+	uint8_t redraw_backoff;
+
+	/* Number of lines drawn all at once, and a pixel at a time */
+	uint64_t fast_lines;
+	uint64_t slow_lines;
+	/* Running hash of the line hashes of every frame published */
+	uint64_t frames_hash;
 };
 
 void gbcc_ppu_clock(struct gbcc_core *gbc);
+void gbcc_ppu_event(struct gbcc_core *gbc);
+void gbcc_ppu_sync(struct gbcc_core *gbc);
+void gbcc_ppu_reschedule(struct gbcc_core *gbc);
+void gbcc_ppu_invalidate_line(struct gbcc_core *gbc);
+void gbcc_ppu_set_palette(struct gbcc_core *gbc, struct palette palette);
+void gbcc_ppu_update_colours(struct gbcc_core *gbc);
+void gbcc_ppu_update_dmg_colours(struct gbcc_core *gbc);
+void gbcc_ppu_update_cgb_colour(struct gbcc_core *gbc, bool sprite, uint8_t index);
 void gbcc_disable_lcd(struct gbcc_core *gbc);
 void gbcc_enable_lcd(struct gbcc_core *gbc);
 
@@ -9,9 +9,14 @@
  */
 
 #include "core.h"
+#include "bit_utils.h"
 #include "debug.h"
+#include "icache.h"
 #include "memory.h"
+#include "nelem.h"
 #include "save.h"
+#include "scheduler.h"
+#include "tile_cache.h"
 #include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -27,14 +32,20 @@
 #define PATH_SEP_STR "/"
 #endif
 
+/* Minimum time between autosaves, in half-clocks */
+#define AUTOSAVE_DELAY (2u * GBC_CLOCK_FREQ)
+
+static bool save_dirty_pages(struct gbcc *gbc);
 static void get_save_basename(struct gbcc *gbc, char savename[MAX_NAME_LEN]);
 static void strip_ext(char *fname);
 static const char *gbcc_basename(const char *fname);
-static bool read_v7_struct(struct gbcc_core *gbc, FILE *f);
 
 void gbcc_save(struct gbcc *gbc)
 {
 	struct gbcc_core *core = &gbc->core;
+	core->cart.mbc.sram_changed = false;
+	core->cart.mbc.last_save_time = core->scheduler.time;
+	memset(core->cart.mbc.sram_dirty, 0, sizeof(core->cart.mbc.sram_dirty));
 	if (core->cart.ram_size == 0 && core->cart.mbc.type != MBC7) {
 		return;
 	}
@@ -78,6 +89,94 @@ void gbcc_save(struct gbcc *gbc)
 	gbcc_log_info("Saved.\n");
 }
 
+/*
+ * Called regularly from the emulation loop. At most once a second, if the game
+ * has written to cartridge RAM since the last save, only the pages it wrote to
+ * are updated in the existing save file, falling back to a full save if there
+ * isn't one.
+ */
+void gbcc_autosave(struct gbcc *gbc)
+{
+	struct gbcc_core *core = &gbc->core;
+	struct gbcc_mbc *mbc = &core->cart.mbc;
+	if (!mbc->sram_changed) {
+		return;
+	}
+	if (core->scheduler.time - mbc->last_save_time < AUTOSAVE_DELAY) {
+		return;
+	}
+	/* The RTC is saved as text after the RAM, so is always rewritten */
+	if (mbc->type == MBC3 || !save_dirty_pages(gbc)) {
+		gbcc_save(gbc);
+	}
+}
+
+/* Returns false if the save file couldn't be updated in place */
+bool save_dirty_pages(struct gbcc *gbc)
+{
+	struct gbcc_core *core = &gbc->core;
+	struct gbcc_mbc *mbc = &core->cart.mbc;
+	size_t n_pages = (core->cart.ram_size + GBCC_SRAM_PAGE_SIZE - 1) / GBCC_SRAM_PAGE_SIZE;
+	bool dirty = false;
+	for (size_t i = 0; i < N_ELEM(mbc->sram_dirty); i++) {
+		dirty |= (mbc->sram_dirty[i] != 0);
+	}
+	if (!dirty && mbc->type != MBC7) {
+		/* Writes to disabled RAM or the like, so nothing to save */
+		mbc->sram_changed = false;
+		return true;
+	}
+	char *fname = malloc(MAX_NAME_LEN);
+	char *tmp = malloc(MAX_NAME_LEN);
+	get_save_basename(gbc, tmp);
+	if (snprintf(fname, MAX_NAME_LEN, "%s.sav", tmp) >= MAX_NAME_LEN) {
+		free(tmp);
+		free(fname);
+		return false;
+	}
+	free(tmp);
+	FILE *sav = fopen(fname, "r+b");
+	free(fname);
+	if (sav == NULL) {
+		return false;
+	}
+
+	/* Write each run of consecutive dirty pages in one go */
+	size_t page = 0;
+	while (page < n_pages) {
+		if (!check_bit(mbc->sram_dirty[page / 8], page % 8)) {
+			page++;
+			continue;
+		}
+		size_t start = page;
+		while (page < n_pages && check_bit(mbc->sram_dirty[page / 8], page % 8)) {
+			page++;
+		}
+		size_t offset = start * GBCC_SRAM_PAGE_SIZE;
+		size_t len = page * GBCC_SRAM_PAGE_SIZE - offset;
+		if (offset + len > core->cart.ram_size) {
+			len = core->cart.ram_size - offset;
+		}
+		if (fseek(sav, (long)offset, SEEK_SET) != 0
+				|| fwrite(core->cart.ram + offset, 1, len, sav) != len) {
+			fclose(sav);
+			return false;
+		}
+	}
+	if (mbc->type == MBC7) {
+		if (fseek(sav, (long)core->cart.ram_size, SEEK_SET) != 0
+				|| fwrite(mbc->eeprom.data, 2, 128, sav) != 128) {
+			fclose(sav);
+			return false;
+		}
+	}
+	fclose(sav);
+	mbc->sram_changed = false;
+	mbc->last_save_time = core->scheduler.time;
+	memset(mbc->sram_dirty, 0, sizeof(mbc->sram_dirty));
+	return true;
+}
+
 void gbcc_load(struct gbcc *gbc)
 {
 	struct gbcc_core *core = &gbc->core;
@@ -161,6 +260,8 @@ void gbcc_save_state(struct gbcc *gbc)
 		free(fname);
 		return;
 	}
+	/* Catch up anything that's being clocked lazily */
+	gbcc_scheduler_sync(core);
 	fwrite(core, sizeof(struct gbcc_core), 1, sav);
 	if (core->cart.ram_size > 0) {
 		fwrite(core->cart.ram, 1, core->cart.ram_size, sav);
@@ -210,8 +311,7 @@ void gbcc_load_state(struct gbcc *gbc)
 		return;
 	}
 	rewind(sav);
-	/* Hardcoded check, should be updated when updating the core version */
-	if (old_version != 7 && old_version != core->version) {
+	if (old_version != core->version) {
 		gbcc_log_error("Save state %d version mismatch, tried "
 				"to load v%u (current version is v%u).\n",
 				gbc->load_state,
@@ -232,14 +332,7 @@ void gbcc_load_state(struct gbcc *gbc)
 	}
 
 	struct gbcc_core *tmp_core = calloc(1, sizeof(*tmp_core));
-	bool read_success = false;
-
-	/* Hardcoded check, should be updated when updating the core version */
-	if (old_version == 7 && gbc->core.version == 8) {
-		read_success = read_v7_struct(tmp_core, sav);
-	} else {
-		read_success = (fread(tmp_core, sizeof(struct gbcc_core), 1, sav) == 1);
-	}
+	bool read_success = (fread(tmp_core, sizeof(struct gbcc_core), 1, sav) == 1);
 	if (!read_success) {
 		gbcc_log_error("Error reading %s: %s\n", fname, strerror(errno));
 		free(tmp_core);
@@ -282,13 +375,16 @@ void gbcc_load_state(struct gbcc *gbc)
 	/* No pointers */
 
 	/* ppu */
-	tmp_core->ppu.screen.buffer_0 = core->ppu.screen.buffer_0;
-	tmp_core->ppu.screen.buffer_1 = core->ppu.screen.buffer_1;
-	tmp_core->ppu.screen.gbc = core->ppu.screen.gbc;
-	tmp_core->ppu.screen.sdl = core->ppu.screen.sdl;
+	tmp_core->ppu.screen.frames = core->ppu.screen.frames;
+	tmp_core->ppu.screen.frame = core->ppu.screen.frame;
+	/*
+	 * The lines drawn so far are from before loading, so start the
+	 * frame's copies of the colours again, to leave room for the rest.
+	 */
+	tmp_core->ppu.screen.frame->n_palettes = 0;
 
 	/* cart */
-	/* No pointers in the mbc */
+	gbcc_mbc_bind(tmp_core);
 	tmp_core->cart.filename = core->cart.filename;
 	tmp_core->cart.rom = core->cart.rom;
 	tmp_core->cart.ram = core->cart.ram;
@@ -325,12 +421,34 @@ void gbcc_load_state(struct gbcc *gbc)
 	tmp_core->memory.wramx = core->memory.wram_bank[wram_bank];
 	tmp_core->memory.echo = core->memory.wram0;
 
+	/* icache */
+	/* RAM contents have changed, but ROM entries are still valid */
+	tmp_core->icache = core->icache;
+	gbcc_icache_flush_ram(tmp_core);
+
+	/* tile cache */
+	tmp_core->tile_cache = core->tile_cache;
+	gbcc_tile_cache_flush(tmp_core);
+
+	/* memory map */
+	gbcc_memory_remap(tmp_core);
+
 	/* printer */
 	/* No pointers */
 
+	/* The save file no longer matches any of the RAM */
+	memset(tmp_core->cart.mbc.sram_dirty, 0xFF, sizeof(tmp_core->cart.mbc.sram_dirty));
+	tmp_core->cart.mbc.sram_changed = true;
+
 	/* Reset some things that shouldn't be saved */
 	memset(&tmp_core->keys, 0, sizeof(tmp_core->keys));
 	tmp_core->sync_to_video = core->sync_to_video;
+	tmp_core->cycle_accurate = core->cycle_accurate;
+	tmp_core->block_executor = core->block_executor;
+	tmp_core->idle_skip = core->idle_skip;
+	tmp_core->frame_skip = core->frame_skip;
+	tmp_core->frame_skip_auto = core->frame_skip_auto;
+	tmp_core->indexed_output = core->indexed_output;
 	tmp_core->error_msg = NULL;
 
 	/* Perform the actual switch */
@@ -418,24 +536,3 @@ const char *gbcc_basename(const char *fname)
 	const char *ret = strrchr(fname, PATH_SEP);
 	return ret ? ret + 1 : fname;
 }
-
-/*
- * In-place conversion from the previous core struct version to this one.
- * This is a dirty hack, but the alternative is trusting users to not rely on
- * savestates when upgrading.
- * Proper serialisation of the core struct would be nice....
- * WARNING: This needs to be updated when changing the core version.
- */
-bool read_v7_struct(struct gbcc_core *gbc, FILE *f)
-{
-	/*
-	 * v8 added cheats - luckily we can just ignore the lost values this
-	 * time, as they don't matter, and re-zero the cheats struct.
-	 */
-	size_t old_size = sizeof(*gbc) - sizeof(gbc->cheats);
-	bool success = fread(gbc, old_size, 1, f) == 1;
-	memset(&gbc->cheats, 0, sizeof(gbc->cheats));
-	gbc->version = GBCC_SAVE_STATE_VERSION;
-	gbc->initialised = true;
-	return success;
-}
@@ -14,6 +14,7 @@
 #include "gbcc.h"
 
 void gbcc_save(struct gbcc *gbc);
+void gbcc_autosave(struct gbcc *gbc);
 void gbcc_load(struct gbcc *gbc);
 void gbcc_save_state(struct gbcc *gbc);
 void gbcc_load_state(struct gbcc *gbc);
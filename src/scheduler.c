@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "core.h"
+#include "apu.h"
+#include "hdma.h"
+#include "memory.h"
+#include "nelem.h"
+#include "ppu.h"
+#include "scheduler.h"
+#include "timer.h"
+
+static void update_next(struct gbcc_scheduler *sched);
+
+void gbcc_scheduler_init(struct gbcc_core *gbc)
+{
+	struct gbcc_scheduler *sched = &gbc->scheduler;
+	sched->time = 0;
+	for (size_t i = 0; i < N_ELEM(sched->events); i++) {
+		sched->events[i] = GBCC_SCHEDULER_NEVER;
+	}
+	sched->next = GBCC_SCHEDULER_NEVER;
+}
+
+void gbcc_scheduler_schedule(struct gbcc_core *gbc, enum gbcc_event event, uint64_t time)
+{
+	struct gbcc_scheduler *sched = &gbc->scheduler;
+	sched->events[event] = time;
+	if (time < sched->next) {
+		sched->next = time;
+	} else {
+		update_next(sched);
+	}
+}
+
+void gbcc_scheduler_cancel(struct gbcc_core *gbc, enum gbcc_event event)
+{
+	gbcc_scheduler_schedule(gbc, event, GBCC_SCHEDULER_NEVER);
+}
+
+/*
+ * Bring every lazily clocked subsystem up to date, e.g. before the core is
+ * written out as a save state.
+ */
+void gbcc_scheduler_sync(struct gbcc_core *gbc)
+{
+	gbcc_apu_sync(gbc);
+	gbcc_ppu_sync(gbc);
+	gbcc_timer_sync(gbc, gbc->scheduler.time);
+	gbcc_memory_dma_sync(gbc);
+	gbcc_hdma_sync(gbc);
+}
+
+void update_next(struct gbcc_scheduler *sched)
+{
+	uint64_t next = GBCC_SCHEDULER_NEVER;
+	for (size_t i = 0; i < N_ELEM(sched->events); i++) {
+		if (sched->events[i] < next) {
+			next = sched->events[i];
+		}
+	}
+	sched->next = next;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef GBCC_SCHEDULER_H
+#define GBCC_SCHEDULER_H
+
+#include <stdint.h>
+
+/*
+ * Scheduler times are measured in half-clocks, so each call to
+ * gbcc_emulate_cycle() advances the time by 2. The PPU, APU and single speed
+ * CPU all run on the even half, while the odd half is only used by the CPU
+ * in double speed mode.
+ */
+#define GBCC_SCHEDULER_NEVER UINT64_MAX
+
+/* Time of the current (or most recent) PPU & APU clock */
+#define GBCC_SCHEDULER_DOT(time) ((time) & ~(uint64_t)1u)
+
+struct gbcc_core;
+
+enum gbcc_event {
+	GBCC_EVENT_APU,
+	GBCC_EVENT_PPU,
+	GBCC_EVENT_SERIAL,
+	GBCC_EVENT_TIMER,
+	GBCC_NUM_EVENTS
+};
+
+struct gbcc_scheduler {
+	uint64_t time;
+	uint64_t next;
+	uint64_t events[GBCC_NUM_EVENTS];
+};
+
+void gbcc_scheduler_init(struct gbcc_core *gbc);
+void gbcc_scheduler_schedule(struct gbcc_core *gbc, enum gbcc_event event, uint64_t time);
+void gbcc_scheduler_cancel(struct gbcc_core *gbc, enum gbcc_event event);
+void gbcc_scheduler_sync(struct gbcc_core *gbc);
+
+#endif /* GBCC_SCHEDULER_H */
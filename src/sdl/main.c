@@ -25,7 +25,6 @@
 #include "sdl.h"
 #include "vram_window.h"
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -79,7 +78,6 @@ int main(int argc, char **argv)
 		gbcc_sdl_update(&sdl);
 		gbcc_sdl_process_input(&sdl);
 	}
-	sem_post(&gbc->core.ppu.vsync_semaphore);
 	if (!force_quit) {
 		pthread_join(emu_thread, NULL);
 	}
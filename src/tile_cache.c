@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "core.h"
+#include "bit_utils.h"
+#include "debug.h"
+#include "tile_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void decode(struct gbcc_core *gbc, size_t tile);
+
+void gbcc_tile_cache_init(struct gbcc_core *gbc)
+{
+	struct gbcc_tile_cache *cache = malloc(sizeof(*cache));
+	if (!cache) {
+		gbcc_log_error("Failed to allocate tile cache.\n");
+		gbc->error = true;
+		gbc->error_msg = "Couldn't allocate tile cache.\n";
+		return;
+	}
+	gbc->tile_cache = cache;
+	gbcc_tile_cache_flush(gbc);
+}
+
+void gbcc_tile_cache_free(struct gbcc_core *gbc)
+{
+	free(gbc->tile_cache);
+	gbc->tile_cache = NULL;
+}
+
+/*
+ * Returns the 8 colour indices of the row of a tile whose first byte is at
+ * offset into the given VRAM bank, left to right as drawn.
+ */
+const uint8_t *gbcc_tile_cache_row(struct gbcc_core *gbc, uint8_t bank, uint16_t offset, bool flip)
+{
+	struct gbcc_tile_cache *cache = gbc->tile_cache;
+	size_t tile = bank * GBCC_TILES_PER_BANK + offset / 16u;
+	if (check_bit(cache->dirty[tile / 8], tile % 8)) {
+		decode(gbc, tile);
+	}
+	return cache->pixels[tile][flip][(offset % 16u) / 2u];
+}
+
+/* Called on every write to VRAM, which goes to the currently selected bank */
+void gbcc_tile_cache_write(struct gbcc_core *gbc, uint16_t addr)
+{
+	struct gbcc_tile_cache *cache = gbc->tile_cache;
+	uint16_t offset = addr - VRAM_START;
+	if (offset >= GBCC_TILE_DATA_SIZE) {
+		/* Tile maps */
+		return;
+	}
+	size_t bank = gbc->memory.vram != gbc->memory.vram_bank[0];
+	size_t tile = bank * GBCC_TILES_PER_BANK + offset / 16u;
+	cache->dirty[tile / 8] = set_bit(cache->dirty[tile / 8], tile % 8);
+}
+
+/* Mark every tile dirty, e.g. after loading a save state */
+void gbcc_tile_cache_flush(struct gbcc_core *gbc)
+{
+	memset(gbc->tile_cache->dirty, 0xFFu, sizeof(gbc->tile_cache->dirty));
+}
+
+void gbcc_tile_decode_row(uint8_t lo, uint8_t hi, uint8_t pixels[8])
+{
+	for (uint8_t x = 0; x < 8; x++) {
+		pixels[x] = (uint8_t)(check_bit(hi, 7 - x) << 1u) | check_bit(lo, 7 - x);
+	}
+}
+
+void decode(struct gbcc_core *gbc, size_t tile)
+{
+	struct gbcc_tile_cache *cache = gbc->tile_cache;
+	const uint8_t *data = &gbc->memory.vram_bank[tile / GBCC_TILES_PER_BANK][16 * (tile % GBCC_TILES_PER_BANK)];
+	for (int y = 0; y < 8; y++) {
+		uint8_t *row = cache->pixels[tile][0][y];
+		uint8_t *flipped = cache->pixels[tile][1][y];
+		gbcc_tile_decode_row(data[2 * y], data[2 * y + 1], row);
+		for (int x = 0; x < 8; x++) {
+			flipped[x] = row[7 - x];
+		}
+	}
+	cache->dirty[tile / 8] = clear_bit(cache->dirty[tile / 8], tile % 8);
+}
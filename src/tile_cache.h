@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef GBCC_TILE_CACHE_H
+#define GBCC_TILE_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Cache of the tiles in VRAM, decoded from 2 bits per pixel into one colour
+ * index per byte, both as stored and flipped horizontally.
+ *
+ * Tiles are marked dirty whenever their VRAM is written to, and are only
+ * decoded again the next time the PPU looks at them.
+ */
+
+#define GBCC_TILE_DATA_SIZE 0x1800u
+#define GBCC_TILES_PER_BANK (GBCC_TILE_DATA_SIZE / 16u)
+#define GBCC_TILE_CACHE_TILES (2 * GBCC_TILES_PER_BANK)
+
+struct gbcc_core;
+
+struct gbcc_tile_cache {
+	/* Indexed by [tile][flipped][row][x] */
+	uint8_t pixels[GBCC_TILE_CACHE_TILES][2][8][8];
+	/* One bit per tile, set if it needs decoding again */
+	uint8_t dirty[GBCC_TILE_CACHE_TILES / 8];
+};
+
+void gbcc_tile_cache_init(struct gbcc_core *gbc);
+void gbcc_tile_cache_free(struct gbcc_core *gbc);
+const uint8_t *gbcc_tile_cache_row(struct gbcc_core *gbc, uint8_t bank, uint16_t offset, bool flip);
+void gbcc_tile_cache_write(struct gbcc_core *gbc, uint16_t addr);
+void gbcc_tile_cache_flush(struct gbcc_core *gbc);
+void gbcc_tile_decode_row(uint8_t lo, uint8_t hi, uint8_t pixels[8]);
+
+#endif /* GBCC_TILE_CACHE_H */
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "core.h"
+#include "apu.h"
+#include "bit_utils.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "timer.h"
+
+static void advance(struct gbcc_core *gbc, uint64_t time);
+static void tick(struct gbcc_core *gbc);
+static void skip(struct gbcc_core *gbc, uint64_t clocks);
+static uint64_t quiet_clocks(struct gbcc_core *gbc);
+static uint16_t tac_period(struct gbcc_core *gbc);
+static uint16_t apu_period(struct gbcc_core *gbc);
+
+/*
+ * Called on a clock that does more than just count. This runs after the CPU
+ * has been clocked in the same half-clock.
+ */
+void gbcc_timer_event(struct gbcc_core *gbc)
+{
+	advance(gbc, gbc->scheduler.time);
+	gbcc_timer_reschedule(gbc);
+}
+
+/*
+ * Apply every clock up to and including the given scheduler time. The CPU
+ * runs before the timer in each half-clock, so anything it reads should only
+ * see the clocks before the current time.
+ */
+void gbcc_timer_sync(struct gbcc_core *gbc, uint64_t time)
+{
+	advance(gbc, time);
+}
+
+/*
+ * Called after anything that changes when the next interesting clock will
+ * be, e.g. a write to one of the timer registers.
+ */
+void gbcc_timer_reschedule(struct gbcc_core *gbc)
+{
+	struct gbcc_timer *timer = &gbc->timer;
+	uint64_t clocks = quiet_clocks(gbc);
+	if (clocks == UINT64_MAX) {
+		gbcc_scheduler_cancel(gbc, GBCC_EVENT_TIMER);
+		return;
+	}
+	clocks++;
+	uint64_t time;
+	if (gbc->cpu.double_speed) {
+		time = timer->sync_time + clocks;
+	} else {
+		time = GBCC_SCHEDULER_DOT(timer->sync_time) + 2 * clocks;
+	}
+	gbcc_scheduler_schedule(gbc, GBCC_EVENT_TIMER, time);
+}
+
+/*
+ * Called by STOP to switch CPU speed. The timer clock in this half-clock
+ * happens after the switch, and so sees the new speed, even when switching
+ * back to single speed on an odd half-clock.
+ */
+void gbcc_timer_switch_speed(struct gbcc_core *gbc)
+{
+	uint64_t now = gbc->scheduler.time;
+	advance(gbc, now - 1);
+	gbc->cpu.double_speed = !gbc->cpu.double_speed;
+	tick(gbc);
+	gbc->timer.sync_time = now;
+	gbcc_timer_reschedule(gbc);
+}
+
+uint8_t gbcc_timer_read(struct gbcc_core *gbc, uint16_t addr)
+{
+	advance(gbc, gbc->scheduler.time - 1);
+	if (addr == DIV) {
+		return high_byte(gbc->timer.div);
+	}
+	return gbcc_memory_read_force(gbc, addr);
+}
+
+void gbcc_timer_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val)
+{
+	advance(gbc, gbc->scheduler.time - 1);
+	if (addr == DIV) {
+		/* Any write resets the whole counter */
+		gbc->timer.div = 0;
+	} else {
+		gbcc_memory_write_force(gbc, addr, val);
+	}
+	gbcc_timer_reschedule(gbc);
+}
+
+/*
+ * Apply all of the clocks since the last sync, stepping through the ones
+ * that do something one at a time, and skipping over the rest.
+ */
+void advance(struct gbcc_core *gbc, uint64_t time)
+{
+	struct gbcc_timer *timer = &gbc->timer;
+	if (time <= timer->sync_time) {
+		return;
+	}
+	uint64_t clocks;
+	if (gbc->cpu.double_speed) {
+		clocks = time - timer->sync_time;
+	} else {
+		/* Only clocked on even half-clocks */
+		clocks = time / 2 - timer->sync_time / 2;
+	}
+	timer->sync_time = time;
+	while (clocks > 0) {
+		uint64_t quiet = quiet_clocks(gbc);
+		if (quiet >= clocks) {
+			skip(gbc, clocks);
+			return;
+		}
+		skip(gbc, quiet);
+		tick(gbc);
+		clocks -= quiet + 1;
+	}
+}
+
+/* A single clock of the counter, and everything that hangs off it */
+void tick(struct gbcc_core *gbc)
+{
+	struct gbcc_timer *timer = &gbc->timer;
+	timer->div++;
+	/*
+	 * TIMA register detects the falling edge of a bit in the internal DIV
+	 * timer, which is selected by TAC. If TAC is disabled, this will
+	 * always see 0.
+	 */
+	uint16_t mask = tac_period(gbc) >> 1u;
+	bool old_bit = timer->tac_bit;
+	timer->tac_bit = timer->div & mask;
+	if (old_bit && !timer->tac_bit) {
+		uint8_t tima = gbcc_memory_read_force(gbc, TIMA);
+		tima++;
+		if (tima == 0) {
+			/*
+			 * TIMA overflow
+			 * Rather than being reloaded immediately, TIMA takes
+			 * 4 cycles to be reloaded, and another 4 to write,
+			 * so we just queue it here. This also affects the
+			 * interrupt.
+			 */
+			timer->reload = 8;
+		}
+		gbcc_memory_write_force(gbc, TIMA, tima);
+	}
+	if (timer->reload > 0) {
+		timer->reload--;
+		if (timer->reload == 4) {
+			/*
+			 * Some more weird behaviour here: if TIMA has been
+			 * written to while this copy & interrupt are waiting,
+			 * they get cancelled, and everything proceeds as
+			 * normal.
+			 */
+			if (gbcc_memory_read_force(gbc, TIMA) != 0) {
+				timer->reload = 0;
+			} else {
+				gbcc_memory_write_force(gbc, TIMA, gbcc_memory_read_force(gbc, TMA));
+				gbcc_memory_set_bit(gbc, IF, 2);
+			}
+		}
+		else if (timer->reload == 0) {
+			gbcc_memory_write_force(gbc, TIMA, gbcc_memory_read_force(gbc, TMA));
+		}
+	}
+	if (!gbc->apu.disabled) {
+		/* APU also updates based on falling edge of DIV timer bit */
+		mask = apu_period(gbc) >> 1u;
+		old_bit = gbc->apu.div_bit;
+		gbc->apu.div_bit = timer->div & mask;
+		if (old_bit && !gbc->apu.div_bit) {
+			gbcc_apu_sequencer_clock(gbc);
+		}
+	}
+}
+
+/* Apply some clocks which quiet_clocks() said only count */
+void skip(struct gbcc_core *gbc, uint64_t clocks)
+{
+	struct gbcc_timer *timer = &gbc->timer;
+	if (clocks == 0) {
+		return;
+	}
+	uint16_t period = tac_period(gbc);
+	if (period > 0) {
+		uint64_t ticks = ((timer->div & (period - 1u)) + clocks) / period;
+		uint8_t tima = gbcc_memory_read_force(gbc, TIMA);
+		gbcc_memory_write_force(gbc, TIMA, (uint8_t)(tima + ticks));
+	}
+	timer->div = (uint16_t)(timer->div + clocks);
+	timer->tac_bit = timer->div & (period >> 1u);
+	if (!gbc->apu.disabled) {
+		gbc->apu.div_bit = timer->div & (apu_period(gbc) >> 1u);
+	}
+}
+
+/*
+ * The number of upcoming clocks which do nothing more than count, and
+ * increment TIMA without overflowing it. The clock after these is the next
+ * one that has to be stepped through, or UINT64_MAX if there isn't one.
+ */
+uint64_t quiet_clocks(struct gbcc_core *gbc)
+{
+	struct gbcc_timer *timer = &gbc->timer;
+	if (timer->reload > 0) {
+		return 0;
+	}
+	uint64_t clocks = UINT64_MAX;
+	uint16_t period = tac_period(gbc);
+	/* A write to DIV or TAC can cause a falling edge on the next clock */
+	if (timer->tac_bit != (bool)(timer->div & (period >> 1u))) {
+		return 0;
+	}
+	if (period > 0) {
+		uint8_t tima = gbcc_memory_read_force(gbc, TIMA);
+		uint64_t overflow = period - (timer->div & (period - 1u));
+		overflow += (uint64_t)(0xFFu - tima) * period;
+		clocks = overflow - 1u;
+	}
+	if (!gbc->apu.disabled) {
+		/* Similarly after a speed switch, or the APU being turned on */
+		period = apu_period(gbc);
+		if (gbc->apu.div_bit != (bool)(timer->div & (period >> 1u))) {
+			return 0;
+		}
+		uint64_t edge = period - (timer->div & (period - 1u));
+		if (edge - 1u < clocks) {
+			clocks = edge - 1u;
+		}
+	}
+	return clocks;
+}
+
+/* Clocks per TIMA increment, or 0 if TIMA is disabled */
+uint16_t tac_period(struct gbcc_core *gbc)
+{
+	static const uint16_t periods[4] = {1024, 16, 64, 256};
+	uint8_t tac = gbcc_memory_read_force(gbc, TAC);
+	if (!check_bit(tac, 2)) {
+		return 0;
+	}
+	return periods[tac & 0x03u];
+}
+
+/* Clocks per APU frame sequencer clock */
+uint16_t apu_period(struct gbcc_core *gbc)
+{
+	/* In double speed, the frame sequencer uses the next bit up */
+	return gbc->cpu.double_speed ? bit16(14) : bit16(13);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef GBCC_TIMER_H
+#define GBCC_TIMER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * DIV, TIMA and the APU frame sequencer are all driven by one 16-bit counter,
+ * which ticks once per CPU clock (so twice per cycle in double speed).
+ *
+ * Rather than being ticked every clock, the counter is only brought up to
+ * date when something reads or writes the timer registers. The clocks which
+ * actually do something other than count (TIMA overflowing and reloading,
+ * and the frame sequencer being clocked) are scheduled as events instead.
+ */
+
+struct gbcc_core;
+
+struct gbcc_timer {
+	/* Scheduler time of the last clock that has been applied */
+	uint64_t sync_time;
+	/* The internal counter, of which DIV is the top byte */
+	uint16_t div;
+	/* Clocks left until TMA is copied to TIMA after an overflow */
+	uint8_t reload;
+	/* Value of the DIV bit selected by TAC at the last clock */
+	bool tac_bit;
+};
+
+void gbcc_timer_event(struct gbcc_core *gbc);
+void gbcc_timer_sync(struct gbcc_core *gbc, uint64_t time);
+void gbcc_timer_reschedule(struct gbcc_core *gbc);
+void gbcc_timer_switch_speed(struct gbcc_core *gbc);
+uint8_t gbcc_timer_read(struct gbcc_core *gbc, uint16_t addr);
+void gbcc_timer_write(struct gbcc_core *gbc, uint16_t addr, uint8_t val);
+
+#endif /* GBCC_TIMER_H */
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#include "core.h"
+#include "debug.h"
+#include "time_diff.h"
+#include "triple_buffer.h"
+#include <stdlib.h>
+#include <time.h>
+
+/* Set in middle until the frontend takes the frame */
+#define FRESH 0x80u
+#define INDEX_MASK 0x03u
+
+/* How often to check, and how long to wait, for the frontend to take a frame */
+#define WAIT_TIME (SECOND / 4096)
+#define WAIT_TIMEOUT (SECOND / 10)
+
+void gbcc_triple_buffer_init(struct gbcc_core *gbc)
+{
+	struct gbcc_triple_buffer *tb = calloc(1, sizeof(*tb));
+	if (!tb) {
+		goto ERROR;
+	}
+	for (int i = 0; i < 3; i++) {
+		tb->buffers[i] = calloc(1, sizeof(*tb->buffers[i]));
+		if (!tb->buffers[i]) {
+			goto ERROR;
+		}
+	}
+	tb->back = 0;
+	tb->front = 1;
+	atomic_init(&tb->middle, 2);
+	gbc->ppu.screen.frames = tb;
+	gbc->ppu.screen.frame = tb->buffers[tb->back];
+	return;
+ERROR:
+	if (tb) {
+		for (int i = 0; i < 3; i++) {
+			free(tb->buffers[i]);
+		}
+		free(tb);
+	}
+	gbcc_log_error("Failed to allocate screen buffers.\n");
+	gbc->error = true;
+	gbc->error_msg = "Couldn't allocate screen buffers.\n";
+}
+
+void gbcc_triple_buffer_free(struct gbcc_core *gbc)
+{
+	struct gbcc_triple_buffer *tb = gbc->ppu.screen.frames;
+	if (!tb) {
+		return;
+	}
+	for (int i = 0; i < 3; i++) {
+		free(tb->buffers[i]);
+	}
+	free(tb);
+	gbc->ppu.screen.frames = NULL;
+	gbc->ppu.screen.frame = NULL;
+}
+
+/*
+ * Called by the emulation thread once the back buffer holds a whole frame.
+ * Returns the frame to draw next.
+ */
+struct gbcc_frame *gbcc_triple_buffer_publish(struct gbcc_triple_buffer *tb)
+{
+	/* Release, so that the frame is visible before its index */
+	uint_fast8_t old = atomic_exchange_explicit(&tb->middle, tb->back | FRESH, memory_order_acq_rel);
+	tb->back = old & INDEX_MASK;
+	return tb->buffers[tb->back];
+}
+
+/* Whether the frontend has taken the last published frame */
+bool gbcc_triple_buffer_taken(struct gbcc_triple_buffer *tb)
+{
+	return !(atomic_load_explicit(&tb->middle, memory_order_acquire) & FRESH);
+}
+
+/*
+ * Used to sync to video, by waiting for the frontend to take the last frame
+ * before starting on the next one. This gives up eventually, so that
+ * emulation can't hang if nothing is displaying frames, e.g. while quitting.
+ */
+void gbcc_triple_buffer_wait(struct gbcc_triple_buffer *tb)
+{
+	struct timespec start;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!gbcc_triple_buffer_taken(tb)) {
+		const struct timespec time = {.tv_sec = 0, .tv_nsec = WAIT_TIME};
+		nanosleep(&time, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (gbcc_time_diff(&now, &start) > WAIT_TIMEOUT) {
+			return;
+		}
+	}
+}
+
+/*
+ * Called by the frontend to swap in the newest finished frame, if there's
+ * one it hasn't seen yet. Returns whether the front buffer changed.
+ */
+bool gbcc_triple_buffer_take(struct gbcc_triple_buffer *tb)
+{
+	if (gbcc_triple_buffer_taken(tb)) {
+		return false;
+	}
+	/* Acquire, so that the frame is visible after its index */
+	uint_fast8_t old = atomic_exchange_explicit(&tb->middle, tb->front, memory_order_acq_rel);
+	tb->front = old & INDEX_MASK;
+	return true;
+}
+
+/* The frame the frontend should be displaying */
+const struct gbcc_frame *gbcc_triple_buffer_front(const struct gbcc_triple_buffer *tb)
+{
+	return tb->buffers[tb->front];
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2017-2020 Philip Jones
+ *
+ * Licensed under the MIT License.
+ * See either the LICENSE file, or:
+ *
+ * https://opensource.org/licenses/MIT
+ *
+ */
+
+#ifndef GBCC_TRIPLE_BUFFER_H
+#define GBCC_TRIPLE_BUFFER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Handing finished frames from the emulation thread to the frontend.
+ *
+ * Of the three frames, the PPU draws into one (back), the frontend
+ * displays another (front), and the third holds the newest finished frame
+ * (middle). Each side only ever swaps its own buffer with the middle one, in
+ * a single atomic exchange, so neither can see a frame that's still being
+ * drawn, and neither has to wait for the other.
+ */
+
+struct gbcc_core;
+struct gbcc_frame;
+
+struct gbcc_triple_buffer {
+	struct gbcc_frame *buffers[3];
+	/* Only touched by the emulation thread */
+	uint8_t back;
+	/* Only touched by the frontend */
+	uint8_t front;
+	/* Index of the middle buffer, plus a flag if it hasn't been taken */
+	atomic_uint_fast8_t middle;
+};
+
+void gbcc_triple_buffer_init(struct gbcc_core *gbc);
+void gbcc_triple_buffer_free(struct gbcc_core *gbc);
+struct gbcc_frame *gbcc_triple_buffer_publish(struct gbcc_triple_buffer *tb);
+bool gbcc_triple_buffer_taken(struct gbcc_triple_buffer *tb);
+void gbcc_triple_buffer_wait(struct gbcc_triple_buffer *tb);
+bool gbcc_triple_buffer_take(struct gbcc_triple_buffer *tb);
+const struct gbcc_frame *gbcc_triple_buffer_front(const struct gbcc_triple_buffer *tb);
+
+#endif /* GBCC_TRIPLE_BUFFER_H */
@@ -9,11 +9,11 @@
  */
 
 #include "gbcc.h"
-#include "bit_utils.h"
 #include "constants.h"
 #include "debug.h"
 #include "memory.h"
 #include "nelem.h"
+#include "tile_cache.h"
 #include "window.h"
 #include "vram_window.h"
 #ifdef __ANDROID__
@@ -169,10 +169,16 @@ void gbcc_vram_window_update(struct gbcc *gbc)
 				for (int y = 0; y < 8; y++) {
 					uint8_t lo = gbc->core.memory.vram_bank[bank][16 * (j * VRAM_WINDOW_WIDTH_TILES + i) + 2*y];
 					uint8_t hi = gbc->core.memory.vram_bank[bank][16 * (j * VRAM_WINDOW_WIDTH_TILES + i) + 2*y + 1];
+					/*
+					 * This runs on the window thread, so can't
+					 * use the emulator's tile cache, which is
+					 * updated as it's read.
+					 */
+					uint8_t pixels[8];
+					gbcc_tile_decode_row(lo, hi, pixels);
 					for (uint8_t x = 0; x < 8; x++) {
-						uint8_t colour = (uint8_t)(check_bit(hi, 7 - x) << 1u) | check_bit(lo, 7 - x);
 						uint32_t p = 0;
-						switch (colour) {
+						switch (pixels[x]) {
 							case 3:
 								p = 0x000000ffu;
 								break;
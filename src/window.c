@@ -17,6 +17,7 @@
 #include "nelem.h"
 #include "screenshot.h"
 #include "time_diff.h"
+#include "triple_buffer.h"
 #include "window.h"
 #ifdef __ANDROID__
 #include <GLES3/gl3.h>
@@ -40,6 +41,10 @@ static void render_text(struct gbcc_window *win, const char *text, uint8_t x, ui
 static void render_character(struct gbcc_window *win, unsigned char c, uint8_t x, uint8_t y);
 static void render_box(struct gbcc_window *win, unsigned int x, unsigned int y);
 static void update_timers(struct gbcc *gbc);
+static GLuint create_lookup_texture(GLenum unit, GLint format, GLsizei width, GLsizei height);
+static void copy_line(uint32_t *buffer, const struct gbcc_frame *frame, int y);
+static void upload_lines(const bool *dirty, GLenum format, const void *data, size_t line_size);
+static void expand_frame_gpu(struct gbcc_window *win, const struct gbcc_frame *frame, const bool *dirty);
 
 void gbcc_window_initialise(struct gbcc *gbc)
 {
@@ -78,6 +83,11 @@ void gbcc_window_initialise(struct gbcc *gbc)
 			SHADER_PATH "dotmatrix.frag"
 			);
 
+	win->gl.palette_shader = gbcc_create_shader_program(
+			SHADER_PATH "vert.vert",
+			SHADER_PATH "palette.frag"
+			);
+
 	win->gl.shaders[3].name = "Nothing";
 	win->gl.shaders[3].program = gbcc_create_shader_program(
 			SHADER_PATH "vert.vert",
@@ -181,6 +191,29 @@ void gbcc_window_initialise(struct gbcc *gbc)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
+	/*
+	 * Indexed frames are drawn to the above texture by the palette shader,
+	 * from textures holding the frame's indices, the copy of the colour
+	 * table used by each line, and the copies themselves.
+	 */
+	win->gl.index_texture = create_lookup_texture(3, GL_R8, GBC_SCREEN_WIDTH, GBC_SCREEN_HEIGHT);
+	win->gl.line_palette_texture = create_lookup_texture(4, GL_R8, GBC_SCREEN_HEIGHT, 1);
+	win->gl.palette_texture = create_lookup_texture(5, GL_RGBA, GBCC_COLOURS, GBC_SCREEN_HEIGHT + 1);
+	glUseProgram(win->gl.palette_shader);
+	glUniform1i(glGetUniformLocation(win->gl.palette_shader, "indices"), 3);
+	glUniform1i(glGetUniformLocation(win->gl.palette_shader, "line_palettes"), 4);
+	glUniform1i(glGetUniformLocation(win->gl.palette_shader, "palettes"), 5);
+
+	glGenFramebuffers(1, &win->gl.palette_fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, win->gl.palette_fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, win->gl.texture, 0);
+	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		gbcc_log_error("Palette framebuffer is not complete!\n");
+		exit(EXIT_FAILURE);
+	}
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, read_framebuffer);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, draw_framebuffer);
+
 	/* This is the 3D texture we use as a lookup-table for colour correction */
 	glGenTextures(1, &win->gl.lut_texture);
 
@@ -229,6 +262,11 @@ void gbcc_window_deinitialise(struct gbcc *gbc)
 	glDeleteRenderbuffers(1, &win->gl.rbo);
 	glDeleteTextures(1, &win->gl.texture);
 	glDeleteTextures(1, &win->gl.lut_texture);
+	glDeleteFramebuffers(1, &win->gl.palette_fbo);
+	glDeleteTextures(1, &win->gl.index_texture);
+	glDeleteTextures(1, &win->gl.line_palette_texture);
+	glDeleteTextures(1, &win->gl.palette_texture);
+	glDeleteProgram(win->gl.palette_shader);
 	for (size_t i = 0; i < N_ELEM(win->gl.shaders); i++) {
 		glDeleteProgram(win->gl.shaders[i].program);
 	}
@@ -258,12 +296,40 @@ void gbcc_window_update(struct gbcc *gbc)
 
 	bool screenshot = win->screenshot || win->raw_screenshot;
 
-	memcpy(win->buffer, gbc->core.ppu.screen.sdl, GBC_SCREEN_SIZE * sizeof(win->buffer[0]));
-	{
-		int val = 0;
-		sem_getvalue(&gbc->core.ppu.vsync_semaphore, &val);
-		if (!val) {
-			sem_post(&gbc->core.ppu.vsync_semaphore);
+	gbcc_triple_buffer_take(gbc->core.ppu.screen.frames);
+	const struct gbcc_frame *frame = gbcc_triple_buffer_front(gbc->core.ppu.screen.frames);
+
+	/*
+	 * Indexed frames have their colours looked up by the GPU, unless
+	 * something has to be drawn over them, or read back from the buffer.
+	 */
+	bool overlay = gbc->menu.show || gbc->show_fps || win->msg.time_left > 0;
+	bool expand_on_gpu = frame->indexed && !overlay && !screenshot;
+
+	/*
+	 * Only lines which have changed since they were last drawn need to be
+	 * copied and uploaded again. Anything drawn over the screen isn't in
+	 * the hashes, so the whole screen is redrawn while and after it's
+	 * shown, as it is after switching between the CPU & GPU paths.
+	 */
+	if (overlay || expand_on_gpu != win->lines.on_gpu) {
+		win->lines.valid = false;
+	}
+	bool dirty[GBC_SCREEN_HEIGHT];
+	bool any_dirty = false;
+	for (int y = 0; y < GBC_SCREEN_HEIGHT; y++) {
+		dirty[y] = !win->lines.valid || frame->line_hash[y] != win->lines.hash[y];
+		any_dirty |= dirty[y];
+		win->lines.hash[y] = frame->line_hash[y];
+	}
+	win->lines.valid = !overlay;
+	win->lines.on_gpu = expand_on_gpu;
+
+	if (!expand_on_gpu) {
+		for (int y = 0; y < GBC_SCREEN_HEIGHT; y++) {
+			if (dirty[y]) {
+				copy_line(win->buffer, frame, y);
+			}
 		}
 	}
 
@@ -293,12 +359,17 @@ void gbcc_window_update(struct gbcc *gbc)
 		}
 	}
 
-	for (size_t i = 0; i < N_ELEM(win->buffer); i++) {
-		uint32_t tmp = win->buffer[i];
-		win->buffer[i] = (tmp & 0xFFu) << 24u
-				| (tmp & 0xFF00u) << 8u
-				| (tmp & 0xFF0000u) >> 8u
-				| (tmp & 0xFF000000u) >> 24u;
+	if (!expand_on_gpu) {
+		for (size_t i = 0; i < N_ELEM(win->buffer); i++) {
+			if (!dirty[i / GBC_SCREEN_WIDTH]) {
+				continue;
+			}
+			uint32_t tmp = win->buffer[i];
+			win->buffer[i] = (tmp & 0xFFu) << 24u
+					| (tmp & 0xFF00u) << 8u
+					| (tmp & 0xFF0000u) >> 8u
+					| (tmp & 0xFF000000u) >> 24u;
+		}
 	}
 
 	/* Setup - resize our screen textures if needed */
@@ -312,28 +383,48 @@ void gbcc_window_update(struct gbcc *gbc)
 	win->x = ((unsigned int)win->width - width) / 2;
 	win->y = ((unsigned int)win->height - height) / 2;
 
-	glBindTexture(GL_TEXTURE_2D, win->gl.fbo_texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	glBindTexture(GL_TEXTURE_2D, win->gl.last_frame_texture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	if (width != win->gl.fbo_width || height != win->gl.fbo_height) {
+		glBindTexture(GL_TEXTURE_2D, win->gl.fbo_texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, win->gl.last_frame_texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, 0);
 
-	glBindRenderbuffer(GL_RENDERBUFFER, win->gl.rbo);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
-	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glBindRenderbuffer(GL_RENDERBUFFER, win->gl.rbo);
+		glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
 
-	/* First pass - render the gbc screen to the framebuffer */
-	glBindFramebuffer(GL_FRAMEBUFFER, win->gl.fbo);
-	glViewport(0, 0, width, height);
-	glClearColor(0.0, 0.0, 0.0, 1.0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	glBindTexture(GL_TEXTURE_2D, win->gl.texture);
-	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GBC_SCREEN_WIDTH, GBC_SCREEN_HEIGHT, GL_RGBA,
-			GL_UNSIGNED_BYTE, (GLvoid *)win->buffer);
-	glUseProgram(win->gl.shaders[win->gl.cur_shader].program);
-	glUniform1i(glGetUniformLocation(win->gl.shaders[win->gl.cur_shader].program, "tex"), 0);
-	glUniform1i(glGetUniformLocation(win->gl.shaders[win->gl.cur_shader].program, "lut"), 1);
-	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+		win->gl.fbo_width = width;
+		win->gl.fbo_height = height;
+		win->gl.fbo_valid = false;
+	}
+
+	/*
+	 * If nothing has changed, the framebuffer already holds this frame,
+	 * and only needs putting back on the screen.
+	 */
+	bool redraw = any_dirty || !win->gl.fbo_valid || win->gl.fbo_shader != win->gl.cur_shader;
+	if (redraw) {
+		if (expand_on_gpu && any_dirty) {
+			expand_frame_gpu(win, frame, dirty);
+		}
+
+		/* First pass - render the gbc screen to the framebuffer */
+		glBindFramebuffer(GL_FRAMEBUFFER, win->gl.fbo);
+		glViewport(0, 0, width, height);
+		glClearColor(0.0, 0.0, 0.0, 1.0);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glBindTexture(GL_TEXTURE_2D, win->gl.texture);
+		if (!expand_on_gpu) {
+			upload_lines(dirty, GL_RGBA, win->buffer, GBC_SCREEN_WIDTH * sizeof(win->buffer[0]));
+		}
+		glUseProgram(win->gl.shaders[win->gl.cur_shader].program);
+		glUniform1i(glGetUniformLocation(win->gl.shaders[win->gl.cur_shader].program, "tex"), 0);
+		glUniform1i(glGetUniformLocation(win->gl.shaders[win->gl.cur_shader].program, "lut"), 1);
+		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+		win->gl.fbo_shader = win->gl.cur_shader;
+		win->gl.fbo_valid = true;
+	}
 
 	/* Second pass - render the framebuffer to the screen */
 	glBindFramebuffer(GL_READ_FRAMEBUFFER, read_framebuffer);
@@ -350,19 +441,106 @@ void gbcc_window_update(struct gbcc *gbc)
 	glUniform1i(glGetUniformLocation(win->gl.base_shader, "frameblending"), gbc->frame_blending);
 	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
 
-	/* Copy the intermediate frame texture for frameblending next time */
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, win->gl.fbo);
-	glBindTexture(GL_TEXTURE_2D, win->gl.last_frame_texture);
-	glReadBuffer(GL_COLOR_ATTACHMENT0);
-	glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 0, 0, width, height, 0);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	glBindFramebuffer(GL_READ_FRAMEBUFFER, read_framebuffer);
+	/*
+	 * Copy the intermediate frame texture for frameblending next time,
+	 * unless it's the same as last time.
+	 */
+	if (redraw) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, win->gl.fbo);
+		glBindTexture(GL_TEXTURE_2D, win->gl.last_frame_texture);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 0, 0, width, height, 0);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, read_framebuffer);
+	}
 
 	if (screenshot) {
 		gbcc_screenshot(gbc);
 	}
 }
 
+/* A texture of raw data for a shader to texelFetch() from, bound to unit */
+GLuint create_lookup_texture(GLenum unit, GLint format, GLsizei width, GLsizei height)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glActiveTexture(GL_TEXTURE0 + unit);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0,
+			(format == (GLint)GL_R8) ? GL_RED : GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	/* Without mipmaps, the default filter would leave it incomplete */
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glActiveTexture(GL_TEXTURE0);
+	return texture;
+}
+
+/* Copy line y of the frame to the buffer, looking up its colours if needed */
+void copy_line(uint32_t *buffer, const struct gbcc_frame *frame, int y)
+{
+	uint32_t *out = &buffer[y * GBC_SCREEN_WIDTH];
+	if (!frame->indexed) {
+		memcpy(out, &frame->colours[y * GBC_SCREEN_WIDTH], GBC_SCREEN_WIDTH * sizeof(*out));
+		return;
+	}
+	const uint32_t *palette = frame->palettes[frame->line_palette[y]];
+	const uint8_t *line = &frame->indices[y * GBC_SCREEN_WIDTH];
+	for (int x = 0; x < GBC_SCREEN_WIDTH; x++) {
+		out[x] = palette[line[x]];
+	}
+}
+
+/*
+ * Upload each run of dirty lines of data to the texture bound to the active
+ * unit, which is a screen's worth of lines of line_size bytes.
+ */
+void upload_lines(const bool *dirty, GLenum format, const void *data, size_t line_size)
+{
+	const uint8_t *bytes = data;
+	for (int y = 0; y < GBC_SCREEN_HEIGHT;) {
+		if (!dirty[y]) {
+			y++;
+			continue;
+		}
+		int start = y;
+		while (y < GBC_SCREEN_HEIGHT && dirty[y]) {
+			y++;
+		}
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, start, GBC_SCREEN_WIDTH, y - start, format,
+				GL_UNSIGNED_BYTE, (const GLvoid *)&bytes[(size_t)start * line_size]);
+	}
+}
+
+/*
+ * Upload the changed lines of an indexed frame, and have the palette shader
+ * draw its colours into win->gl.texture, in place of an upload of colours.
+ * The line palettes are small, and numbered differently each frame, so
+ * they're always uploaded in full.
+ */
+void expand_frame_gpu(struct gbcc_window *win, const struct gbcc_frame *frame, const bool *dirty)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, win->gl.palette_fbo);
+	glViewport(0, 0, GBC_SCREEN_WIDTH, GBC_SCREEN_HEIGHT);
+
+	glActiveTexture(GL_TEXTURE0 + 3);
+	glBindTexture(GL_TEXTURE_2D, win->gl.index_texture);
+	upload_lines(dirty, GL_RED, frame->indices, GBC_SCREEN_WIDTH);
+	glActiveTexture(GL_TEXTURE0 + 4);
+	glBindTexture(GL_TEXTURE_2D, win->gl.line_palette_texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GBC_SCREEN_HEIGHT, 1, GL_RED,
+			GL_UNSIGNED_BYTE, (GLvoid *)frame->line_palette);
+	glActiveTexture(GL_TEXTURE0 + 5);
+	glBindTexture(GL_TEXTURE_2D, win->gl.palette_texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, GBCC_COLOURS, frame->n_palettes, GL_RGBA,
+			GL_UNSIGNED_BYTE, (GLvoid *)frame->palettes);
+	glActiveTexture(GL_TEXTURE0);
+	/* Don't leave the target bound where it could be sampled */
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glUseProgram(win->gl.palette_shader);
+	glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+}
+
 void gbcc_load_shader(GLuint shader, const char *filename)
 {
 	errno = 0;
@@ -58,10 +58,34 @@ struct gbcc_window {
 		GLuint rbo;
 		GLuint texture;
 		GLuint lut_texture;
+		/* For looking up the colours of indexed frames */
+		GLuint palette_fbo;
+		GLuint index_texture;
+		GLuint line_palette_texture;
+		GLuint palette_texture;
+		GLuint palette_shader;
 		GLuint base_shader;
 		int cur_shader;
 		struct shader shaders[4];
+		/*
+		 * Size of the post-processing framebuffer, and whether it
+		 * still holds the screen texture drawn with cur_shader
+		 */
+		unsigned int fbo_width;
+		unsigned int fbo_height;
+		int fbo_shader;
+		bool fbo_valid;
 	} gl;
+	/*
+	 * Hashes of the lines in the screen texture (and buffer, unless they
+	 * were drawn by the palette shader), so that only the lines which
+	 * have changed are uploaded.
+	 */
+	struct {
+		uint64_t hash[GBC_SCREEN_HEIGHT];
+		bool valid;
+		bool on_gpu;
+	} lines;
 	struct fps_counter fps;
 	struct {
 		char text[MSG_BUF_SIZE];
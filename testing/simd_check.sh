@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Check that the SIMD compositing paths draw exactly the same frames as the
+# plain C loop, by running each ROM through both gbcc-bench and
+# gbcc-bench-no-simd (built with -Dbench-no-simd=true) and comparing the
+# hashes of the final state and every frame drawn, in both RGBA and indexed
+# colour modes.
+#
+# Usage: simd_check.sh build_dir rom_file...
+#
+# The number of frames can be set with FRAMES (default 600).
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 build_dir rom_file..." >&2
+	exit 1
+fi
+
+build_dir=$1
+shift
+frames=${FRAMES:-600}
+
+for bench in gbcc-bench gbcc-bench-no-simd; do
+	if [ ! -x "$build_dir/$bench" ]; then
+		echo "$build_dir/$bench not found, configure with -Dbench-no-simd=true." >&2
+		exit 1
+	fi
+done
+
+simd=$(mktemp)
+plain=$(mktemp)
+trap 'rm -f "$simd" "$plain"' EXIT
+
+# Keep just the ROM names, mode names and hashes, not the timings
+hashes() {
+	awk '/^\t/ { print $1, $11 } /^[^\t[]/ { print }' "$1" > "$1.hashes"
+	mv "$1.hashes" "$1"
+}
+
+status=0
+for flags in "" "-i"; do
+	"$build_dir/gbcc-bench" $flags -f "$frames" "$@" > "$simd" 2>/dev/null || status=1
+	"$build_dir/gbcc-bench-no-simd" $flags -f "$frames" "$@" > "$plain" 2>/dev/null || status=1
+	hashes "$simd"
+	hashes "$plain"
+	if ! diff -u "$plain" "$simd"; then
+		echo "SIMD and plain compositing disagree (flags: ${flags:-none})." >&2
+		status=1
+	fi
+done
+
+if [ $status -eq 0 ]; then
+	echo "SIMD and plain compositing agree."
+fi
+exit $status